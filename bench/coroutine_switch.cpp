@@ -0,0 +1,45 @@
+// Measures the cost of one push/pull round trip through each generator_node coroutine backend.
+//
+//     cl /O2 /EHsc /std:c++17 /I.. coroutine_switch.cpp
+
+#include "../tasket_coroutine2.h"
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+
+template<typename Coroutines>
+double nanoseconds_per_switch(std::uint64_t count)
+{
+    std::uint64_t sum = 0;
+
+    typename Coroutines::template push_type<std::uint64_t> sink([&](typename Coroutines::template pull_type<std::uint64_t>& source)
+    {
+        for (auto v : source)
+            sum += v;
+    });
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (std::uint64_t n = 0; n < count; ++n)
+        sink(n);
+
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    if (sum != count * (count - 1) / 2)
+        std::cerr << "unexpected sum\n";
+
+    return std::chrono::duration<double, std::nano>(elapsed).count() / count;
+}
+
+int main()
+{
+    const std::uint64_t count = 10000000;
+
+    // NOTE: Warm up both stacks and the caches before measuring.
+    nanoseconds_per_switch<tasket::boost_coroutines>(count / 10);
+    nanoseconds_per_switch<tasket::fcontext_coroutines>(count / 10);
+
+    std::cout << "boost_coroutines:    " << nanoseconds_per_switch<tasket::boost_coroutines>(count) << " ns/switch\n";
+    std::cout << "fcontext_coroutines: " << nanoseconds_per_switch<tasket::fcontext_coroutines>(count) << " ns/switch\n";
+}
@@ -0,0 +1,151 @@
+// Parses the same in-memory CSV with parallel_pipeline and with an equivalent chain of generator_nodes
+// (read -> parse -> sum), and reports the time per line for each.
+//
+//     cl /O2 /EHsc /std:c++17 /I.. pipeline.cpp
+
+#include "../tasket.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+static std::vector<std::string> make_lines(std::size_t count)
+{
+    std::vector<std::string> lines;
+    lines.reserve(count);
+
+    for (std::size_t n = 0; n < count; ++n)
+    {
+        std::string line;
+        for (std::size_t field = 0; field < 16; ++field)
+        {
+            if (field > 0)
+                line += ',';
+            line += std::to_string(n * 31 + field);
+        }
+        lines.push_back(std::move(line));
+    }
+
+    return lines;
+}
+
+static std::int64_t parse(const std::string& line)
+{
+    std::int64_t sum = 0;
+
+    auto p = line.c_str();
+    while (*p)
+    {
+        char* end = nullptr;
+        sum += std::strtoll(p, &end, 10);
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    return sum;
+}
+
+template<typename F>
+static double nanoseconds_per_line(std::size_t lines, F&& f)
+{
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    return std::chrono::duration<double, std::nano>(elapsed).count() / lines;
+}
+
+static std::int64_t run_pipeline(const std::vector<std::string>& lines, std::size_t tokens)
+{
+    tasket::executor executor;
+
+    std::size_t next = 0;
+    std::int64_t total = 0;
+
+    auto pipeline =
+        tasket::make_stage<void, const std::string*>(tasket::filter_mode::serial_in_order, [&](tasket::flow_control& control) -> const std::string*
+        {
+            if (next == lines.size())
+            {
+                control.stop();
+                return nullptr;
+            }
+            return &lines[next++];
+        }) &
+        tasket::make_stage<const std::string*, std::int64_t>(tasket::filter_mode::parallel, [](const std::string* line)
+        {
+            return parse(*line);
+        }) &
+        tasket::make_stage<std::int64_t, void>(tasket::filter_mode::serial_in_order, [&](std::int64_t sum)
+        {
+            total += sum;
+        });
+
+    tasket::parallel_pipeline(executor, tokens, pipeline);
+
+    return total;
+}
+
+static std::int64_t run_generators(const std::vector<std::string>& lines)
+{
+    tasket::executor executor;
+
+    std::int64_t total = 0;
+
+    tasket::generator_node<int, const std::string*> read(executor, [&](tasket::pull_type<int>& source, tasket::push_type<const std::string*>& sink)
+    {
+        for (auto start : source)
+        {
+            for (auto& line : lines)
+                sink(&line);
+        }
+    });
+
+    tasket::generator_node<const std::string*, std::int64_t> parse_lines(executor, [](tasket::pull_type<const std::string*>& source, tasket::push_type<std::int64_t>& sink)
+    {
+        for (auto line : source)
+            sink(parse(*line));
+    });
+
+    tasket::generator_node<std::int64_t, int> sum(executor, [&](tasket::pull_type<std::int64_t>& source, tasket::push_type<int>&)
+    {
+        for (auto v : source)
+            total += v;
+    });
+
+    tasket::make_edge(read, parse_lines);
+    tasket::make_edge(parse_lines, sum);
+
+    int start = 0;
+    read.try_put(start, nullptr);
+
+    executor.wait_for_all();
+
+    return total;
+}
+
+int main()
+{
+    const std::size_t count = 1000000;
+
+    auto lines = make_lines(count);
+
+    std::int64_t expected = 0;
+    for (auto& line : lines)
+        expected += parse(line);
+
+    for (std::size_t tokens : { 1, 4, 16, 64 })
+    {
+        std::int64_t total = 0;
+        auto ns = nanoseconds_per_line(count, [&] { total = run_pipeline(lines, tokens); });
+
+        std::cout << "parallel_pipeline (" << tokens << " tokens): " << ns << " ns/line" << (total == expected ? "" : " (wrong total)") << "\n";
+    }
+
+    std::int64_t total = 0;
+    auto ns = nanoseconds_per_line(count, [&] { total = run_generators(lines); });
+
+    std::cout << "generator_node chain:           " << ns << " ns/line" << (total == expected ? "" : " (wrong total)") << "\n";
+}
@@ -6,20 +6,142 @@
 
 #include <boost/coroutine/coroutine.hpp>
 #include <boost/optional.hpp>
+#include <boost/variant.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <condition_variable>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <exception>
 #include <functional>
+#include <limits>
 #include <list>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <unordered_map>
+#include <unordered_set>
 #include <queue>
+#include <random>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 namespace tasket
 {
+    // NOTE: See tasket_coroutine2.h for the Boost.Coroutine2 backend.
+    struct boost_coroutines
+    {
+        template<typename T>
+        using pull_type = boost::coroutines::pull_coroutine<T>;
+        template<typename T>
+        using push_type = boost::coroutines::push_coroutine<T>;
+    };
+
     template<typename T>
-    using pull_type = boost::coroutines::pull_coroutine<T>;
+    using pull_type = boost_coroutines::pull_type<T>;
     template<typename T>
-    using push_type = boost::coroutines::push_coroutine<T>;
+    using push_type = boost_coroutines::push_type<T>;
+
+    // Lets a generator body hand its worker thread back while it waits for an external event, such as the
+    // I/O helpers in tasket_io.h. suspend() switches out of the body to the executor task running the
+    // generator. That task then calls start with a resume function, and calling resume (from any thread)
+    // continues the body as a new executor task.
+    class generator_suspension
+    {
+    public:
+        using resume_type = std::function<void()>;
+        using start_type = std::function<void(resume_type)>;
+
+        // The suspension of the generator body running on this thread, or nullptr outside one.
+        static generator_suspension* current()
+        {
+            return current_ref();
+        }
+
+        // NOTE: start runs once the body is off the thread, so it may call resume right away.
+        void suspend(start_type start)
+        {
+            ASSERT(yield_);
+
+            pending_ref() = std::move(start);
+            yield_();
+        }
+
+        // Driven by the generator nodes: source is the body's input coroutine, which yields to the node.
+        template<typename Source>
+        void attach(Source& source)
+        {
+            yield_ = [&source]
+            {
+                source();
+            };
+        }
+
+        // Runs one step of the body on this thread. Returns false if it suspended instead of asking for input.
+        template<typename Step>
+        bool run(Step&& step)
+        {
+            current_ref() = this;
+            step();
+            current_ref() = nullptr;
+
+            return !pending_ref();
+        }
+
+        // Whether the step that just returned to this thread's executor task left a suspended body behind.
+        static bool suspended()
+        {
+            return static_cast<bool>(pending_ref());
+        }
+
+        static void start(resume_type resume)
+        {
+            auto start = std::move(pending_ref());
+            pending_ref() = nullptr;
+
+            start(std::move(resume));
+        }
+    private:
+
+        // NOTE: Thread local, so a body resumed elsewhere can't race with the task it left.
+        static generator_suspension*& current_ref()
+        {
+            thread_local generator_suspension* current = nullptr;
+            return current;
+        }
+
+        static start_type& pending_ref()
+        {
+            thread_local start_type pending;
+            return pending;
+        }
+
+        std::function<void()> yield_;
+    };
 
     struct scoped_oversubscription
     {
@@ -75,6 +197,207 @@ namespace tasket
         std::atomic<int>            wait_count_;
     };
 
+    // Runs tick on the executor every period until destroyed. The timer task sleeps with concurrency::wait,
+    // which is a cooperative block, so it does not hold on to a virtual processor between ticks.
+    class periodic_timer
+    {
+    public:
+
+        template<typename Tick>
+        periodic_timer(executor& executor, std::chrono::milliseconds period, Tick&& tick)
+            : tick_(std::forward<Tick>(tick))
+            , stopped_(false)
+            , running_(true)
+        {
+            executor.run([=]
+            {
+                while (!stopped_)
+                {
+                    concurrency::wait(static_cast<unsigned int>(period.count()));
+
+                    if (!stopped_)
+                        tick_();
+                }
+
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                running_ = false;
+                cond_.notify_one();
+            });
+        }
+
+        ~periodic_timer()
+        {
+            stopped_ = true;
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [this] { return !running_; }); // NOTE: Cooperative block.
+        }
+
+        periodic_timer(const periodic_timer&) = delete;
+        periodic_timer(periodic_timer&&) = delete;
+
+        periodic_timer& operator=(const periodic_timer&) = delete;
+        periodic_timer& operator=(periodic_timer&&) = delete;
+    private:
+        std::function<void()>       tick_;
+        std::atomic<bool>           stopped_;
+        bool                        running_;
+        std::condition_variable_any cond_;
+        std::mutex                  mutex_;
+    };
+
+    // Bump allocator with per-size free lists, so blocks of a size that is freed again (container nodes,
+    // bucket arrays) are reused. Chunks are only returned all at once by reset().
+    class arena
+    {
+    public:
+
+        explicit arena(std::size_t chunk_size = 64 * 1024)
+            : chunk_size_(chunk_size)
+            , current_(nullptr)
+            , remaining_(0)
+        {
+        }
+
+        arena(const arena&) = delete;
+        arena(arena&&) = delete;
+
+        arena& operator=(const arena&) = delete;
+        arena& operator=(arena&&) = delete;
+
+        void* allocate(std::size_t size, std::size_t alignment)
+        {
+            if (alignment <= alignof(std::max_align_t))
+            {
+                size = rounded(size);
+
+                auto it = free_.find(size);
+                if (it != free_.end() && it->second)
+                {
+                    auto result = it->second;
+                    it->second = *static_cast<void**>(result);
+
+                    return result;
+                }
+
+                alignment = alignof(std::max_align_t);
+            }
+
+            auto padding = (alignment - reinterpret_cast<std::uintptr_t>(current_) % alignment) % alignment;
+
+            if (!current_ || padding + size > remaining_)
+            {
+                auto chunk_size = std::max(chunk_size_, size + alignment);
+
+                chunks_.emplace_back(new char[chunk_size]);
+                current_ = chunks_.back().get();
+                remaining_ = chunk_size;
+                padding = (alignment - reinterpret_cast<std::uintptr_t>(current_) % alignment) % alignment;
+            }
+
+            auto result = current_ + padding;
+            current_ += padding + size;
+            remaining_ -= padding + size;
+
+            return result;
+        }
+
+        // NOTE: Blocks with extended alignment are only reclaimed by reset().
+        void deallocate(void* p, std::size_t size, std::size_t alignment)
+        {
+            if (alignment > alignof(std::max_align_t))
+                return;
+
+            auto& head = free_[rounded(size)];
+            *static_cast<void**>(p) = head;
+            head = p;
+        }
+
+        void reset()
+        {
+            chunks_.clear();
+            free_.clear();
+            current_ = nullptr;
+            remaining_ = 0;
+        }
+    private:
+
+        // NOTE: Free blocks hold the free list's next pointer.
+        static std::size_t rounded(std::size_t size)
+        {
+            const std::size_t granularity = alignof(std::max_align_t) > sizeof(void*) ? alignof(std::max_align_t) : sizeof(void*);
+
+            return (std::max<std::size_t>(size, 1) + granularity - 1) / granularity * granularity;
+        }
+
+        const std::size_t                       chunk_size_;
+        std::vector<std::unique_ptr<char[]>>    chunks_;
+        std::unordered_map<std::size_t, void*>  free_;
+        char*                                   current_;
+        std::size_t                             remaining_;
+    };
+
+    template<typename T>
+    class arena_allocator
+    {
+    public:
+        using value_type = T;
+
+        template<typename U>
+        struct rebind
+        {
+            using other = arena_allocator<U>;
+        };
+
+        explicit arena_allocator(arena& a)
+            : arena_(&a)
+        {
+        }
+
+        template<typename U>
+        arena_allocator(const arena_allocator<U>& other)
+            : arena_(other.arena_)
+        {
+        }
+
+        T* allocate(std::size_t n)
+        {
+            return static_cast<T*>(arena_->allocate(n * sizeof(T), alignof(T)));
+        }
+
+        void deallocate(T* p, std::size_t n)
+        {
+            arena_->deallocate(p, n * sizeof(T), alignof(T));
+        }
+
+        template<typename U>
+        bool operator==(const arena_allocator<U>& other) const
+        {
+            return arena_ == other.arena_;
+        }
+
+        template<typename U>
+        bool operator!=(const arena_allocator<U>& other) const
+        {
+            return arena_ != other.arena_;
+        }
+    private:
+        template<typename U>
+        friend class arena_allocator;
+
+        arena* arena_;
+    };
+
+    // Event-time promise that no message older than the watermark will follow on that edge.
+    //
+    // Lock order: a predecessor may deliver a watermark from inside try_get (queue_node flushes a held one
+    // there), so put_watermark can run on a node that is pulling under its own mutex_. Nodes that pull keep
+    // their watermark state under a separate watermark_mutex_, always taken after mutex_ and never before it.
+    using watermark = std::int64_t;
+
+    const watermark end_of_stream = std::numeric_limits<watermark>::max();
+
     template<typename T>
     struct receiver;
 
@@ -90,6 +413,15 @@ namespace tasket
         virtual ~receiver(){}
 
         virtual bool try_put(input_type& i, predecessor_type* s) = 0;
+
+        virtual void register_predecessor(predecessor_type& s)
+        {
+        }
+
+        // NOTE: Nodes that don't track event time ignore watermarks.
+        virtual void put_watermark(watermark w, predecessor_type* s)
+        {
+        }
     };
 
     template<typename T>
@@ -103,12 +435,92 @@ namespace tasket
         virtual bool try_get(output_type& o, successor_type* r) = 0;
 
         virtual void register_successor(successor_type& r) = 0;
+
+        virtual std::size_t pending()
+        {
+            return 0;
+        }
+    };
+
+    // A stage graph::optimize() can evaluate inline on an edge instead of as a node.
+    // NOTE: Once fused, test() is called from every upstream thread without the node's lock, so only
+    //       stages that report stateless() are fused.
+    template<typename T>
+    struct fusable
+    {
+        virtual ~fusable(){}
+
+        virtual bool test(const T& v) = 0;
+
+        // Whether test() may be called concurrently without the node's lock.
+        virtual bool stateless() = 0;
+
+        // Successors attached with make_edge, including those outside any graph.
+        virtual std::size_t successor_count() = 0;
+    };
+
+    struct continue_msg
+    {
+    };
+
+    // Combines the watermarks of a node's inputs: the node's watermark is the minimum over every predecessor
+    // registered through make_edge, and only advances once each of them has reported one.
+    template<typename T>
+    class watermark_tracker
+    {
+    public:
+
+        watermark_tracker()
+            : expected_(0)
+            , current_(std::numeric_limits<watermark>::min())
+        {
+        }
+
+        void add(sender<T>* s)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            ++expected_;
+        }
+
+        // Returns true with the combined watermark in result when it advanced.
+        bool update(watermark w, sender<T>* s, watermark& result)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            auto it = inputs_.find(s);
+            if (it == inputs_.end())
+                it = inputs_.emplace(s, w).first;
+            else
+                it->second = std::max(it->second, w);
+
+            if (inputs_.size() < expected_)
+                return false;
+
+            auto combined = std::numeric_limits<watermark>::max();
+            for (auto& input : inputs_)
+                combined = std::min(combined, input.second);
+
+            if (combined <= current_)
+                return false;
+
+            current_ = combined;
+            result = combined;
+
+            return true;
+        }
+    private:
+        std::size_t                                     expected_;
+        watermark                                       current_;
+        std::unordered_map<sender<T>*, watermark>       inputs_;
+        std::mutex                                      mutex_;
     };
 
     template<typename T>
     void make_edge(sender<T>& s, receiver<T>& r)
     {
         s.register_successor(r);
+        r.register_predecessor(s);
     }
 
     template<typename T>
@@ -120,18 +532,50 @@ namespace tasket
         using predecessor_type = sender<input_type>;
 
         successor_cache(predecessor_type* owner)
-            : owner_(owner)
+            : single_(nullptr)
+            , owner_(owner)
         {
         }
 
         void add(successor_type* r)
         {
-            if (r)
+            if (!r)
+                return;
+
+            if (!single_ && successors_.empty())
+                single_ = r;
+            else
                 successors_.push_back(r);
         }
 
+        // Successors attached with make_edge; unlike add() these are kept for control signals.
+        void register_successor(successor_type* r)
+        {
+            add(r);
+            registered_.push_back(r);
+        }
+
+        std::size_t registered() const
+        {
+            return registered_.size();
+        }
+
+        void put_watermark(watermark w)
+        {
+            for (auto r : registered_)
+                r->put_watermark(w, owner_);
+        }
+
         bool try_put(input_type& i)
         {
+            if (single_)
+            {
+                if (single_->try_put(i, owner_))
+                    return true;
+
+                single_ = nullptr;
+            }
+
             for (auto it = successors_.begin(); it != successors_.end(); it = successors_.erase(it))
             {
                 ASSERT(*it);
@@ -143,8 +587,10 @@ namespace tasket
             return false;
         }
     private:
-        std::list<successor_type*> successors_;
-        predecessor_type*          owner_;
+        successor_type*              single_; // NOTE: 1:1 edges never touch the list.
+        std::list<successor_type*>   successors_;
+        std::vector<successor_type*> registered_;
+        predecessor_type*            owner_;
     };
 
     template<typename T>
@@ -156,18 +602,32 @@ namespace tasket
         using predecessor_type = sender<output_type>;
 
         predecessor_cache(successor_type* owner)
-            : owner_(owner)
+            : single_(nullptr)
+            , owner_(owner)
         {
         }
 
         void add(predecessor_type* s)
         {
-            if (s)
+            if (!s)
+                return;
+
+            if (!single_ && predecessors_.empty())
+                single_ = s;
+            else
                 predecessors_.push_back(s);
         }
 
         bool try_get(output_type& o)
         {
+            if (single_)
+            {
+                if (single_->try_get(o, owner_))
+                    return true;
+
+                single_ = nullptr;
+            }
+
             for (auto it = predecessors_.begin(); it != predecessors_.end(); it = predecessors_.erase(it))
             {
                 ASSERT(*it);
@@ -179,88 +639,477 @@ namespace tasket
             return false;
         }
     private:
+        predecessor_type*            single_; // NOTE: 1:1 edges never touch the list.
         std::list<predecessor_type*> predecessors_;
         successor_type*              owner_;
     };
 
-    template<typename T>
-    class broadcast_node final
-        : public receiver<T>
-        , public sender<T>
+    class graph
     {
     public:
 
-        broadcast_node()
+        struct edge_snapshot
+        {
+            std::string     source;
+            std::string     target;
+            std::uint64_t   messages;
+            double          throughput;   // NOTE: Messages per second since the previous snapshot.
+            std::size_t     queue_depth;
+            double          blocked_time; // NOTE: Seconds the source has spent rejected by the target.
+        };
+
+        graph()
+            : last_snapshot_(std::chrono::steady_clock::now())
         {
         }
 
-        broadcast_node(const broadcast_node&) = delete;
-        broadcast_node(broadcast_node&&) = delete;
+        graph(const graph&) = delete;
+        graph(graph&&) = delete;
 
-        broadcast_node& operator=(const broadcast_node&) = delete;
-        broadcast_node& operator=(broadcast_node&&) = delete;
+        graph& operator=(const graph&) = delete;
+        graph& operator=(graph&&) = delete;
 
-        bool try_put(input_type& i, predecessor_type* s) override
+        template<typename Node>
+        Node& add_node(Node& node, std::string name)
         {
             std::lock_guard<std::mutex> lock(mutex_);
 
-            for (auto successor : successors_)
-                successor->try_put(input_type{ i }, nullptr);
+            names_[dynamic_cast<const void*>(&node)] = std::move(name);
 
-            return true;
+            return node;
         }
 
-        bool try_get(output_type& o, successor_type* r) override
+        template<typename T>
+        void make_edge(sender<T>& s, receiver<T>& r)
         {
-            std::lock_guard<std::mutex> lock(mutex_);
+            std::unique_ptr<edge<T>> e(new edge<T>(s, r));
 
-            successors_.push_back(r);
+            auto& proxy = *e;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
 
-            return false;
+                edges_.push_back(std::move(e));
+            }
+
+            tasket::make_edge(s, proxy);
         }
 
-        void register_successor(successor_type& r) override
+        // Collapses stateless fusable nodes (e.g. filter_node built with predicate_kind::stateless) that
+        // have exactly one incoming and one outgoing graph edge, and no successors outside the graph, into
+        // the incoming edge, which then evaluates them inline (without the node's lock) and delivers
+        // directly to the downstream node. Only edges created through this graph are considered. Must be
+        // called before any messages flow.
+        void optimize()
         {
             std::lock_guard<std::mutex> lock(mutex_);
 
-            successors_.push_back(&r);
-        }
-    private:
-        std::list<successor_type*> successors_;
-        std::mutex                 mutex_;
-    };
-
-
-    template<typename T>
-    class overwrite_node final
-        : public receiver<T>
-        , public sender<T>
-    {
-    public:
+            auto changed = true;
+            while (changed)
+            {
+                changed = false;
 
-        overwrite_node()
-        {
-        }
+                for (auto& e : edges_)
+                {
+                    if (e->fused_ || !e->target_fusable())
+                        continue;
 
-        overwrite_node(const overwrite_node&) = delete;
-        overwrite_node(overwrite_node&&) = delete;
+                    edge_base* in = nullptr;
+                    edge_base* out = nullptr;
+                    auto in_count = 0;
+                    auto out_count = 0;
 
-        overwrite_node& operator=(const overwrite_node&) = delete;
-        overwrite_node& operator=(overwrite_node&&) = delete;
+                    for (auto& e2 : edges_)
+                    {
+                        if (e2->fused_)
+                            continue;
 
-        bool try_put(input_type& i, predecessor_type* s) override
-        {
-            std::lock_guard<std::mutex> lock(mutex_);
+                        if (e2->target_ == e->target_)
+                        {
+                            in = e2.get();
+                            ++in_count;
+                        }
 
-            for (auto successor : successors_)
-                successor->try_put(input_type{ i }, this);
+                        if (e2->source_ == e->target_)
+                        {
+                            out = e2.get();
+                            ++out_count;
+                        }
+                    }
 
-            value_ = std::move(i);
+                    if (in_count != 1 || out_count != 1 || in != e.get() || out == e.get())
+                        continue;
 
-            return true;
+                    if (e->fuse(*out))
+                        changed = true;
+                }
+            }
         }
 
-        bool try_get(output_type& o, successor_type* r) override
+        std::vector<edge_snapshot> snapshot()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            auto now = std::chrono::steady_clock::now();
+            auto elapsed = std::chrono::duration<double>(now - last_snapshot_).count();
+            last_snapshot_ = now;
+
+            std::vector<edge_snapshot> result;
+            for (auto& e : edges_)
+            {
+                if (e->fused_)
+                    continue;
+
+                auto messages = e->messages_.load();
+
+                edge_snapshot s;
+                s.source = name_of(e->source_);
+                s.target = name_of(e->target_);
+                s.messages = messages;
+                s.throughput = elapsed > 0.0 ? (messages - e->last_messages_) / elapsed : 0.0;
+                s.queue_depth = e->pending_source();
+                s.blocked_time = std::chrono::duration<double>(std::chrono::nanoseconds(e->blocked_time(now))).count();
+                result.push_back(std::move(s));
+
+                e->last_messages_ = messages;
+            }
+
+            return result;
+        }
+
+        std::string to_dot()
+        {
+            std::ostringstream out;
+
+            out << "digraph tasket {\n";
+            for (auto& e : snapshot())
+            {
+                out << "    \"" << escape(e.source) << "\" -> \"" << escape(e.target) << "\""
+                    << " [label=\"" << e.messages << " msgs, " << e.throughput << " msg/s, depth " << e.queue_depth << ", blocked " << e.blocked_time << "s\"];\n";
+            }
+            out << "}\n";
+
+            return out.str();
+        }
+
+        std::string to_json()
+        {
+            std::ostringstream out;
+
+            out << "{\"edges\":[";
+            auto first = true;
+            for (auto& e : snapshot())
+            {
+                if (!first)
+                    out << ",";
+                first = false;
+
+                out << "{\"source\":\"" << escape(e.source) << "\""
+                    << ",\"target\":\"" << escape(e.target) << "\""
+                    << ",\"messages\":" << e.messages
+                    << ",\"throughput\":" << e.throughput
+                    << ",\"queue_depth\":" << e.queue_depth
+                    << ",\"blocked_time\":" << e.blocked_time << "}";
+            }
+            out << "]}";
+
+            return out.str();
+        }
+    private:
+
+        struct edge_base
+        {
+            edge_base(const void* source, const void* target)
+                : source_(source)
+                , target_(target)
+                , messages_(0)
+                , blocked_(0)
+                , blocked_since_(0)
+                , last_messages_(0)
+                , fused_(false)
+            {
+            }
+
+            virtual ~edge_base(){}
+
+            virtual std::size_t pending_source() = 0;
+
+            virtual bool target_fusable() = 0;
+
+            virtual bool fuse(edge_base& next) = 0;
+
+            void delivered()
+            {
+                ++messages_;
+
+                auto since = blocked_since_.exchange(0);
+                if (since != 0)
+                    blocked_ += now() - since;
+            }
+
+            void rejected()
+            {
+                std::int64_t expected = 0;
+                blocked_since_.compare_exchange_strong(expected, now());
+            }
+
+            std::int64_t blocked_time(std::chrono::steady_clock::time_point at) const
+            {
+                auto since = blocked_since_.load();
+                auto blocked = blocked_.load();
+
+                if (since != 0)
+                    blocked += std::chrono::duration_cast<std::chrono::nanoseconds>(at.time_since_epoch()).count() - since;
+
+                return blocked;
+            }
+
+            static std::int64_t now()
+            {
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+            }
+
+            const void*                 source_;
+            const void*                 target_;
+            std::atomic<std::uint64_t>  messages_;
+            std::atomic<std::int64_t>   blocked_;
+            std::atomic<std::int64_t>   blocked_since_;
+            std::uint64_t               last_messages_;
+            bool                        fused_;
+        };
+
+        template<typename T>
+        class edge final
+            : public edge_base
+            , public receiver<T>
+            , public sender<T>
+        {
+        public:
+
+            edge(sender<T>& s, receiver<T>& r)
+                : edge_base(dynamic_cast<const void*>(&s), dynamic_cast<const void*>(&r))
+                , source_node_(s)
+                , target_node_(&r)
+            {
+            }
+
+            bool try_put(input_type& i, predecessor_type* s) override
+            {
+                if (!test(i))
+                    return true;
+
+                if (!target_node_->try_put(i, s ? this : nullptr))
+                {
+                    rejected();
+                    return false;
+                }
+
+                delivered();
+
+                return true;
+            }
+
+            bool try_get(output_type& o, successor_type* r) override
+            {
+                while (source_node_.try_get(o, this))
+                {
+                    if (test(o))
+                    {
+                        delivered();
+                        return true;
+                    }
+                }
+
+                return false;
+            }
+
+            void register_successor(successor_type& r) override
+            {
+                ASSERT(&r == target_node_);
+            }
+
+            void register_predecessor(predecessor_type& s) override
+            {
+                target_node_->register_predecessor(*this);
+            }
+
+            void put_watermark(watermark w, predecessor_type* s) override
+            {
+                target_node_->put_watermark(w, this);
+            }
+
+            std::size_t pending_source() override
+            {
+                return source_node_.pending();
+            }
+
+            // NOTE: A node with successors outside the graph must keep seeing every message.
+            bool target_fusable() override
+            {
+                auto stage = dynamic_cast<fusable<T>*>(target_node_);
+
+                return stage && stage->stateless() && stage->successor_count() == 1;
+            }
+
+            bool fuse(edge_base& next) override
+            {
+                auto stage = dynamic_cast<fusable<T>*>(target_node_);
+                auto e = dynamic_cast<edge*>(&next);
+
+                if (!stage || !e)
+                    return false;
+
+                stages_.push_back(stage);
+                stages_.insert(stages_.end(), e->stages_.begin(), e->stages_.end());
+
+                target_node_ = e->target_node_;
+                target_ = e->target_;
+                e->fused_ = true;
+
+                return true;
+            }
+        private:
+
+            bool test(const T& v)
+            {
+                for (auto stage : stages_)
+                {
+                    if (!stage->test(v))
+                        return false;
+                }
+
+                return true;
+            }
+
+            sender<T>&                  source_node_;
+            receiver<T>*                target_node_;
+            std::vector<fusable<T>*>    stages_;
+        };
+
+        std::string name_of(const void* node)
+        {
+            auto it = names_.find(node);
+            if (it != names_.end())
+                return it->second;
+
+            std::ostringstream out;
+            out << "node" << names_.size();
+
+            return names_[node] = out.str();
+        }
+
+        static std::string escape(const std::string& str)
+        {
+            std::string result;
+            for (auto c : str)
+            {
+                if (c == '"' || c == '\\')
+                    result += '\\';
+                result += c;
+            }
+            return result;
+        }
+
+        std::vector<std::unique_ptr<edge_base>>         edges_;
+        std::unordered_map<const void*, std::string>    names_;
+        std::chrono::steady_clock::time_point           last_snapshot_;
+        std::mutex                                      mutex_;
+    };
+
+    template<typename T>
+    class broadcast_node final
+        : public receiver<T>
+        , public sender<T>
+    {
+    public:
+
+        broadcast_node()
+        {
+        }
+
+        broadcast_node(const broadcast_node&) = delete;
+        broadcast_node(broadcast_node&&) = delete;
+
+        broadcast_node& operator=(const broadcast_node&) = delete;
+        broadcast_node& operator=(broadcast_node&&) = delete;
+
+        bool try_put(input_type& i, predecessor_type* s) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            for (auto successor : successors_)
+                successor->try_put(input_type{ i }, nullptr);
+
+            return true;
+        }
+
+        bool try_get(output_type& o, successor_type* r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            successors_.push_back(r);
+
+            return false;
+        }
+
+        void register_successor(successor_type& r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            successors_.push_back(&r);
+        }
+
+        void register_predecessor(predecessor_type& s) override
+        {
+            watermarks_.add(&s);
+        }
+
+        void put_watermark(watermark w, predecessor_type* s) override
+        {
+            if (!watermarks_.update(w, s, w))
+                return;
+
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            for (auto successor : successors_)
+                successor->put_watermark(w, this);
+        }
+    private:
+        std::list<successor_type*> successors_;
+        watermark_tracker<T>       watermarks_;
+        std::mutex                 mutex_;
+    };
+
+
+    template<typename T>
+    class overwrite_node final
+        : public receiver<T>
+        , public sender<T>
+    {
+    public:
+
+        overwrite_node()
+        {
+        }
+
+        overwrite_node(const overwrite_node&) = delete;
+        overwrite_node(overwrite_node&&) = delete;
+
+        overwrite_node& operator=(const overwrite_node&) = delete;
+        overwrite_node& operator=(overwrite_node&&) = delete;
+
+        bool try_put(input_type& i, predecessor_type* s) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            for (auto successor : successors_)
+                successor->try_put(input_type{ i }, this);
+
+            value_ = std::move(i);
+
+            return true;
+        }
+
+        bool try_get(output_type& o, successor_type* r) override
         {
             std::lock_guard<std::mutex> lock(mutex_);
 
@@ -282,9 +1131,26 @@ namespace tasket
 
             successors_.push_back(&r);
         }
+
+        void register_predecessor(predecessor_type& s) override
+        {
+            watermarks_.add(&s);
+        }
+
+        void put_watermark(watermark w, predecessor_type* s) override
+        {
+            if (!watermarks_.update(w, s, w))
+                return;
+
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            for (auto successor : successors_)
+                successor->put_watermark(w, this);
+        }
     private:
         std::list<successor_type*>      successors_;
         boost::optional<input_type>     value_;
+        watermark_tracker<T>            watermarks_;
         std::mutex                      mutex_;
     };
 
@@ -332,6 +1198,12 @@ namespace tasket
             o = std::move(queue_.front());
             queue_.pop();
 
+            if (queue_.empty() && watermark_)
+            {
+                successors_.put_watermark(*watermark_);
+                watermark_.reset();
+            }
+
             return true;
         }
 
@@ -339,27 +1211,64 @@ namespace tasket
         {
             std::lock_guard<std::mutex> lock(mutex_);
 
-            successors_.add(&r);
+            successors_.register_successor(&r);
+        }
+
+        std::size_t pending() override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            return queue_.size();
+        }
+
+        void register_predecessor(predecessor_type& s) override
+        {
+            watermarks_.add(&s);
+        }
+
+        // NOTE: Held back while older messages are still queued.
+        void put_watermark(watermark w, predecessor_type* s) override
+        {
+            if (!watermarks_.update(w, s, w))
+                return;
+
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (queue_.empty())
+                successors_.put_watermark(w);
+            else
+                watermark_ = w;
         }
     private:
         successor_cache<output_type> successors_;
         std::queue<input_type>       queue_;
+        watermark_tracker<T>         watermarks_;
+        boost::optional<watermark>   watermark_;
         std::mutex                   mutex_;
     };
 
-    template<typename T>
+    enum class predicate_kind
+    {
+        stateful,   // Called under the node's lock.
+        stateless   // Safe to call concurrently; lets graph::optimize() fuse the node into an edge.
+    };
+
+    // NOTE: Pass the lambda's type as Predicate to store it inline and let the call be inlined.
+    template<typename T, typename Predicate = std::function<bool(const T&)>>
     class filter_node final
         : public receiver<T>
         , public sender<T>
+        , public fusable<T>
     {
     public:
-        using predicate_type = std::function<bool(const T&)>;
+        using predicate_type = Predicate;
 
-        template<typename Predicate>
-        filter_node(Predicate&& predicate)
+        template<typename P>
+        filter_node(P&& predicate, predicate_kind kind = predicate_kind::stateful)
             : successors_(this)
             , predecessors_(this)
-            , predicate_(std::forward<Predicate>(predicate))
+            , predicate_(std::forward<P>(predicate))
+            , kind_(kind)
         {
         }
 
@@ -407,90 +1316,195 @@ namespace tasket
         {
             std::lock_guard<std::mutex> lock(mutex_);
 
-            successors_.add(&r);
+            successors_.register_successor(&r);
         }
-    private:
-        successor_cache<output_type>    successors_;
-        predecessor_cache<input_type>   predecessors_;
-        predicate_type                  predicate_;
-        std::mutex                      mutex_;
-    };
 
-    template<typename Input, typename Output, typename Generator = std::function<void(pull_type<Input>&, push_type<Output>&)>>
-    class generator_node final
-        : public receiver<Input>
-        , public sender<Output>
-    {
-    public:
+        // NOTE: Called without the node lock once the node has been fused into a graph edge.
+        bool test(const T& v) override
+        {
+            return predicate_(v);
+        }
 
-        using source_type = pull_type<input_type>;
-        using sink_type = push_type<output_type>;
-        using generator_type = Generator;
+        bool stateless() override
+        {
+            return kind_ == predicate_kind::stateless;
+        }
 
-        template<typename Generator>
-        generator_node(executor& executor, Generator&& generator)
-            : executor_(executor)
-            , successors_(this)
-            , predecessors_(this)
-            , output_([&](pull_type<output_type>& source)
+        std::size_t successor_count() override
         {
-            for (auto o : source)
-            {
-                std::unique_lock<std::mutex> lock(mutex_);
+            std::lock_guard<std::mutex> lock(mutex_);
 
-                if (!successors_.try_put(o))
-                    value_ = std::move(o);
+            return successors_.registered();
+        }
 
-                while (value_)
-                    cond_.wait(lock); // NOTE: Cooperative block.
+        void register_predecessor(predecessor_type& s) override
+        {
+            watermarks_.add(&s);
+        }
+
+        // NOTE: Doesn't take the node lock; a consumer pulling through this node may be delivering it.
+        void put_watermark(watermark w, predecessor_type* s) override
+        {
+            if (watermarks_.update(w, s, w))
+                successors_.put_watermark(w);
+        }
+    private:
+        successor_cache<output_type>    successors_;
+        predecessor_cache<input_type>   predecessors_;
+        predicate_type                  predicate_;
+        predicate_kind                  kind_;
+        watermark_tracker<T>            watermarks_;
+        std::mutex                      mutex_;
+    };
+
+    // Copies the elements of in whose bit is set in mask to out, preserving order, and returns the number
+    // copied. out may alias in, and only the copied elements are written, so out needs no slack beyond
+    // them. Elements of 4 or 8 byte trivially copyable types are compacted with AVX-512 compress or AVX2
+    // permute and masked stores when the build targets them; everything else takes the scalar loop.
+    template<typename T>
+    std::size_t compact(const T* in, std::size_t size, const std::uint64_t* mask, T* out)
+    {
+        std::size_t n = 0;
+        std::size_t i = 0;
+
+#if defined(__AVX512F__)
+        if constexpr (std::is_trivially_copyable<T>::value && sizeof(T) == 4)
+        {
+            for (; i + 16 <= size; i += 16)
+            {
+                auto bits = static_cast<__mmask16>(mask[i / 64] >> (i % 64));
+                auto v = _mm512_loadu_si512(in + i);
+                _mm512_mask_compressstoreu_epi32(out + n, bits, v);
+                n += _mm_popcnt_u32(bits);
             }
-        })
-            , generator_(std::bind(std::forward<Generator>(generator), std::placeholders::_1, std::ref(output_)))
-            , input_([&](pull_type<input_type>& source)
+        }
+        else if constexpr (std::is_trivially_copyable<T>::value && sizeof(T) == 8)
         {
-            for (auto i : source)
+            for (; i + 8 <= size; i += 8)
             {
-                while (true)
+                auto bits = static_cast<__mmask8>(mask[i / 64] >> (i % 64));
+                auto v = _mm512_loadu_si512(in + i);
+                _mm512_mask_compressstoreu_epi64(out + n, bits, v);
+                n += _mm_popcnt_u32(bits);
+            }
+        }
+#elif defined(__AVX2__)
+        struct permutation
+        {
+            std::uint32_t lanes[8];
+            std::uint32_t count;
+        };
+
+        static const auto table = []
+        {
+            std::vector<permutation> result(256);
+            for (std::uint32_t bits = 0; bits < 256; ++bits)
+            {
+                auto& p = result[bits];
+                p.count = 0;
+                for (std::uint32_t lane = 0; lane < 8; ++lane)
                 {
-                    generator_(i);
+                    if (bits & (1u << lane))
+                        p.lanes[p.count++] = lane;
+                }
+                for (auto lane = p.count; lane < 8; ++lane)
+                    p.lanes[lane] = 0;
+            }
+            return result;
+        }();
 
-                    std::lock_guard<std::mutex> lock(mutex_);
+        if constexpr (std::is_trivially_copyable<T>::value && (sizeof(T) == 4 || sizeof(T) == 8))
+        {
+            const std::size_t width = 32 / sizeof(T);
+            const auto lane_index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
 
-                    active_ = false;
+            for (; i + width <= size; i += width)
+            {
+                auto bits = static_cast<std::uint32_t>(mask[i / 64] >> (i % 64)) & ((1u << width) - 1);
 
-                    if (!predecessors_.try_get(i))
-                        break;
+                // NOTE: 8 byte elements are moved as pairs of 32 bit lanes.
+                if constexpr (sizeof(T) == 8)
+                    bits = (bits & 1) * 3 | (bits & 2) * 6 | (bits & 4) * 12 | (bits & 8) * 24;
 
-                    active_ = true;
-                }
+                auto& p = table[bits];
+                auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+                auto idx = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p.lanes));
+
+                // NOTE: Only the p.count surviving lanes are stored.
+                auto store = _mm256_cmpgt_epi32(_mm256_set1_epi32(static_cast<int>(p.count)), lane_index);
+                _mm256_maskstore_epi32(reinterpret_cast<int*>(out + n), store, _mm256_permutevar8x32_epi32(v, idx));
+                n += p.count * 4 / sizeof(T);
             }
-        })
-            , active_(false)
+        }
+#endif
+
+        for (; i < size; ++i)
         {
+            if (mask[i / 64] & (std::uint64_t(1) << (i % 64)))
+                out[n++] = in[i];
         }
 
-        generator_node(const generator_node&) = delete;
-        generator_node(generator_node&&) = delete;
+        return n;
+    }
 
-        generator_node& operator=(const generator_node&) = delete;
-        generator_node& operator=(generator_node&&) = delete;
+    // Filters whole batches: the predicate sets bit i of the mask (size / 64 rounded up words, zeroed) for
+    // every element to keep, the survivors are compacted in place and empty batches are dropped.
+    template<typename T>
+    class batch_filter_node final
+        : public receiver<std::vector<T>>
+        , public sender<std::vector<T>>
+    {
+    public:
+        using predicate_type = std::function<void(const T* data, std::size_t size, std::uint64_t* mask)>;
 
-        bool try_put(input_type& i, predecessor_type* s) override
+        template<typename Predicate>
+        batch_filter_node(Predicate&& predicate)
+            : successors_(this)
+            , predecessors_(this)
+            , predicate_(std::forward<Predicate>(predicate))
         {
-            std::lock_guard<std::mutex> lock(mutex_);
+        }
 
-            if (active_ || value_)
+        batch_filter_node(const batch_filter_node&) = delete;
+        batch_filter_node(batch_filter_node&&) = delete;
+
+        batch_filter_node& operator=(const batch_filter_node&) = delete;
+        batch_filter_node& operator=(batch_filter_node&&) = delete;
+
+        void register_predecessor(predecessor_type& s) override
+        {
+            watermarks_.add(&s);
+        }
+
+        void put_watermark(watermark w, predecessor_type* s) override
+        {
+            if (watermarks_.update(w, s, w))
+                successors_.put_watermark(w);
+        }
+
+        // NOTE: Transforms outside the lock. A transformed batch that successors reject is kept here rather
+        // than handed back, since transforming it again when it is pulled would apply the stage twice.
+        bool try_put(input_type& i, predecessor_type* s) override
+        {
             {
-                predecessors_.add(s);
+                std::lock_guard<std::mutex> lock(mutex_);
 
-                return false;
+                if (!queue_.empty())
+                {
+                    predecessors_.add(s);
+
+                    return false;
+                }
             }
 
-            active_ = true;
-            executor_.run([=]
-            {
-                input_(i);
-            });
+            if (!filter(i))
+                return true;
+
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            // NOTE: Concurrent puts can pass the check above together, so this may queue more than one.
+            if (!queue_.empty() || !successors_.try_put(i))
+                queue_.push(std::move(i));
 
             return true;
         }
@@ -499,39 +1513,5971 @@ namespace tasket
         {
             std::lock_guard<std::mutex> lock(mutex_);
 
-            if (!value_)
+            if (!queue_.empty())
             {
-                successors_.add(r);
+                o = std::move(queue_.front());
+                queue_.pop();
 
-                return false;
+                return true;
             }
 
-            o = std::move(*value_);
-            value_.reset();
-            cond_.notify_one();
+            output_type o2;
+            while (predecessors_.try_get(o2))
+            {
+                if (filter(o2))
+                {
+                    o = std::move(o2);
+                    return true;
+                }
+            }
 
-            return true;
+            successors_.add(r);
+
+            return false;
         }
 
         void register_successor(successor_type& r) override
         {
             std::lock_guard<std::mutex> lock(mutex_);
 
-            successors_.add(&r);
+            successors_.register_successor(&r);
+        }
+
+        std::size_t pending() override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            return queue_.size();
         }
     private:
 
-        executor&                       executor_;
+        bool filter(std::vector<T>& batch)
+        {
+            // NOTE: Thread local so concurrent puts don't share (or lock) the mask.
+            static thread_local std::vector<std::uint64_t> mask;
+
+            mask.assign((batch.size() + 63) / 64, 0);
+            predicate_(batch.data(), batch.size(), mask.data());
+
+            batch.resize(compact(batch.data(), batch.size(), mask.data(), batch.data()));
+
+            return !batch.empty();
+        }
+
         successor_cache<output_type>    successors_;
         predecessor_cache<input_type>   predecessors_;
+        std::queue<output_type>         queue_;
+        predicate_type                  predicate_;
+        watermark_tracker<input_type>   watermarks_;
+        std::mutex                      mutex_;
+    };
 
-        bool                            active_;
-        push_type<output_type>          output_;
-        push_type<input_type>           generator_;
-        push_type<input_type>           input_;
+    template<typename T, std::size_t Alignment = 64>
+    class aligned_allocator
+    {
+    public:
+        using value_type = T;
 
-        boost::optional<output_type>    value_;
-        std::condition_variable         cond_;
-        std::mutex                      mutex_;
+        template<typename U>
+        struct rebind
+        {
+            using other = aligned_allocator<U, Alignment>;
+        };
+
+        aligned_allocator()
+        {
+        }
+
+        template<typename U>
+        aligned_allocator(const aligned_allocator<U, Alignment>&)
+        {
+        }
+
+        T* allocate(std::size_t n)
+        {
+            // NOTE: Over-allocates and keeps the original pointer just before the aligned block.
+            auto raw = static_cast<char*>(::operator new(n * sizeof(T) + Alignment + sizeof(void*)));
+            auto aligned = reinterpret_cast<std::uintptr_t>(raw + sizeof(void*) + Alignment - 1) & ~static_cast<std::uintptr_t>(Alignment - 1);
+            reinterpret_cast<void**>(aligned)[-1] = raw;
+
+            return reinterpret_cast<T*>(aligned);
+        }
+
+        void deallocate(T* p, std::size_t)
+        {
+            ::operator delete(reinterpret_cast<void**>(p)[-1]);
+        }
+
+        template<typename U>
+        bool operator==(const aligned_allocator<U, Alignment>&) const
+        {
+            return true;
+        }
+
+        template<typename U>
+        bool operator!=(const aligned_allocator<U, Alignment>&) const
+        {
+            return false;
+        }
+    };
+
+    // Base for objects that must each own a cache line, such as per-worker state: heap allocations go
+    // through aligned_allocator, since plain new only honours alignas(64) from C++17 on.
+    struct alignas(64) cache_aligned
+    {
+        static void* operator new(std::size_t size)
+        {
+            return aligned_allocator<char>().allocate(size);
+        }
+
+        static void operator delete(void* p)
+        {
+            aligned_allocator<char>().deallocate(static_cast<char*>(p), 0);
+        }
+    };
+
+    // Struct-of-arrays batch of rows. Each field lives in its own cache line aligned column; the optional
+    // selection vector lists the row indices still alive so filters never move column data.
+    template<typename... Fields>
+    class column_batch
+    {
+    public:
+
+        template<std::size_t N>
+        using field_type = typename std::tuple_element<N, std::tuple<Fields...>>::type;
+
+        template<typename T>
+        using column_type = std::vector<T, aligned_allocator<T>>;
+
+        using selection_type = std::vector<std::uint32_t>;
+
+        column_batch()
+            : size_(0)
+            , selected_(false)
+        {
+        }
+
+        explicit column_batch(std::size_t capacity)
+            : column_batch()
+        {
+            reserve(capacity);
+        }
+
+        std::size_t size() const
+        {
+            return size_;
+        }
+
+        // Number of rows that survived filtering.
+        std::size_t count() const
+        {
+            return selected_ ? selection_.size() : size_;
+        }
+
+        void reserve(std::size_t capacity)
+        {
+            for_each_column([=](auto& column) { column.reserve(capacity); }, std::index_sequence_for<Fields...>());
+        }
+
+        void resize(std::size_t size)
+        {
+            for_each_column([=](auto& column) { column.resize(size); }, std::index_sequence_for<Fields...>());
+            size_ = size;
+        }
+
+        void push_back(const Fields&... values)
+        {
+            push_back(std::forward_as_tuple(values...), std::index_sequence_for<Fields...>());
+            ++size_;
+        }
+
+        template<std::size_t N>
+        field_type<N>* column()
+        {
+            return std::get<N>(columns_).data();
+        }
+
+        template<std::size_t N>
+        const field_type<N>* column() const
+        {
+            return std::get<N>(columns_).data();
+        }
+
+        bool has_selection() const
+        {
+            return selected_;
+        }
+
+        const selection_type& selection() const
+        {
+            return selection_;
+        }
+
+        void select(selection_type selection)
+        {
+            selection_ = std::move(selection);
+            selected_ = true;
+        }
+
+        void clear_selection()
+        {
+            selection_.clear();
+            selected_ = false;
+        }
+
+        // Calls f(row) for every selected row.
+        template<typename F>
+        void for_each_row(F&& f) const
+        {
+            if (selected_)
+            {
+                for (auto row : selection_)
+                    f(row);
+            }
+            else
+            {
+                for (std::uint32_t row = 0; row < size_; ++row)
+                    f(row);
+            }
+        }
+    private:
+
+        template<typename F, std::size_t... N>
+        void for_each_column(F&& f, std::index_sequence<N...>)
+        {
+            int dummy[] = { 0, (f(std::get<N>(columns_)), 0)... };
+            (void)dummy;
+        }
+
+        template<typename Tuple, std::size_t... N>
+        void push_back(const Tuple& values, std::index_sequence<N...>)
+        {
+            int dummy[] = { 0, (std::get<N>(columns_).push_back(std::get<N>(values)), 0)... };
+            (void)dummy;
+        }
+
+        std::tuple<column_type<Fields>...>  columns_;
+        std::size_t                         size_;
+        selection_type                      selection_;
+        bool                                selected_;
+    };
+
+    // Base for column operators that rewrite a batch in place; apply returns false to drop the batch.
+    template<typename Batch>
+    class column_stage
+        : public receiver<Batch>
+        , public sender<Batch>
+    {
+    public:
+
+        column_stage()
+            : successors_(this)
+            , predecessors_(this)
+        {
+        }
+
+        column_stage(const column_stage&) = delete;
+        column_stage(column_stage&&) = delete;
+
+        column_stage& operator=(const column_stage&) = delete;
+        column_stage& operator=(column_stage&&) = delete;
+
+        void register_predecessor(predecessor_type& s) override
+        {
+            watermarks_.add(&s);
+        }
+
+        void put_watermark(watermark w, predecessor_type* s) override
+        {
+            if (watermarks_.update(w, s, w))
+                successors_.put_watermark(w);
+        }
+
+        // NOTE: Transforms outside the lock. A transformed batch that successors reject is kept here rather
+        // than handed back, since transforming it again when it is pulled would apply the stage twice.
+        bool try_put(input_type& i, predecessor_type* s) override
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                if (!queue_.empty())
+                {
+                    predecessors_.add(s);
+
+                    return false;
+                }
+            }
+
+            if (!apply(i))
+                return true;
+
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            // NOTE: Concurrent puts can pass the check above together, so this may queue more than one.
+            if (!queue_.empty() || !successors_.try_put(i))
+                queue_.push(std::move(i));
+
+            return true;
+        }
+
+        bool try_get(output_type& o, successor_type* r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (!queue_.empty())
+            {
+                o = std::move(queue_.front());
+                queue_.pop();
+
+                return true;
+            }
+
+            output_type o2;
+            while (predecessors_.try_get(o2))
+            {
+                if (apply(o2))
+                {
+                    o = std::move(o2);
+                    return true;
+                }
+            }
+
+            successors_.add(r);
+
+            return false;
+        }
+
+        void register_successor(successor_type& r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            successors_.register_successor(&r);
+        }
+
+        std::size_t pending() override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            return queue_.size();
+        }
+    protected:
+
+        virtual bool apply(Batch& batch) = 0;
+    private:
+        successor_cache<output_type>    successors_;
+        predecessor_cache<input_type>   predecessors_;
+        std::queue<output_type>         queue_;
+        watermark_tracker<Batch>        watermarks_;
+        std::mutex                      mutex_;
+    };
+
+    // Narrows the selection to rows whose column N satisfies the predicate, without moving any column data.
+    template<typename Batch, std::size_t N, typename Predicate>
+    class column_filter_node final
+        : public column_stage<Batch>
+    {
+    public:
+
+        template<typename P>
+        column_filter_node(P&& predicate)
+            : predicate_(std::forward<P>(predicate))
+        {
+        }
+    private:
+
+        bool apply(Batch& batch) override
+        {
+            auto column = batch.template column<N>();
+
+            typename Batch::selection_type selection(batch.count());
+
+            // NOTE: Branch-free; the index is always written and only kept when the predicate holds.
+            std::size_t n = 0;
+            if (batch.has_selection())
+            {
+                for (auto row : batch.selection())
+                {
+                    selection[n] = row;
+                    n += predicate_(column[row]) ? 1 : 0;
+                }
+            }
+            else
+            {
+                for (std::uint32_t row = 0; row < batch.size(); ++row)
+                {
+                    selection[n] = row;
+                    n += predicate_(column[row]) ? 1 : 0;
+                }
+            }
+
+            selection.resize(n);
+            batch.select(std::move(selection));
+
+            return n > 0;
+        }
+
+        Predicate predicate_;
+    };
+
+    // Rewrites column N in place. Without a selection the whole column is transformed in one contiguous
+    // loop that vectorizes; with one, only the selected rows are, so the function never sees a filtered row.
+    template<typename Batch, std::size_t N, typename Function>
+    class column_map_node final
+        : public column_stage<Batch>
+    {
+    public:
+
+        template<typename F>
+        column_map_node(F&& function)
+            : function_(std::forward<F>(function))
+        {
+        }
+    private:
+
+        bool apply(Batch& batch) override
+        {
+            auto column = batch.template column<N>();
+
+            if (batch.has_selection())
+            {
+                for (auto row : batch.selection())
+                    column[row] = function_(column[row]);
+            }
+            else
+            {
+                auto size = batch.size();
+
+                for (std::size_t row = 0; row < size; ++row)
+                    column[row] = function_(column[row]);
+            }
+
+            return true;
+        }
+
+        Function function_;
+    };
+
+    // Folds the selected rows of column N of each batch into one Acc per batch.
+    template<typename Batch, std::size_t N, typename Acc, typename Function>
+    class column_aggregate_node final
+        : public receiver<Batch>
+        , public sender<Acc>
+    {
+    public:
+
+        template<typename F>
+        column_aggregate_node(Acc init, F&& function)
+            : successors_(this)
+            , predecessors_(this)
+            , init_(std::move(init))
+            , function_(std::forward<F>(function))
+            , stored_(false)
+        {
+        }
+
+        column_aggregate_node(const column_aggregate_node&) = delete;
+        column_aggregate_node(column_aggregate_node&&) = delete;
+
+        column_aggregate_node& operator=(const column_aggregate_node&) = delete;
+        column_aggregate_node& operator=(column_aggregate_node&&) = delete;
+
+        bool try_put(input_type& i, predecessor_type* s) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (value_)
+            {
+                predecessors_.add(s);
+
+                return false;
+            }
+
+            auto o = aggregate(i);
+
+            if (!successors_.try_put(o))
+            {
+                value_ = std::move(o);
+                stored(true);
+            }
+
+            return true;
+        }
+
+        bool try_get(output_type& o, successor_type* r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (value_)
+            {
+                o = std::move(*value_);
+                value_.reset();
+                stored(false);
+
+                return true;
+            }
+
+            input_type i;
+            if (predecessors_.try_get(i))
+            {
+                o = aggregate(i);
+
+                return true;
+            }
+
+            successors_.add(r);
+
+            return false;
+        }
+
+        void register_successor(successor_type& r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            successors_.register_successor(&r);
+        }
+
+        std::size_t pending() override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            return value_ ? 1 : 0;
+        }
+
+        void register_predecessor(predecessor_type& s) override
+        {
+            watermarks_.add(&s);
+        }
+
+        // NOTE: Held back while an undelivered aggregate is stored.
+        void put_watermark(watermark w, predecessor_type* s) override
+        {
+            if (!watermarks_.update(w, s, w))
+                return;
+
+            std::lock_guard<std::mutex> watermark_lock(watermark_mutex_);
+
+            if (!stored_)
+                successors_.put_watermark(w);
+            else
+                watermark_ = w;
+        }
+    private:
+
+        // NOTE: Mirrors value_ under watermark_mutex_.
+        void stored(bool value)
+        {
+            std::lock_guard<std::mutex> watermark_lock(watermark_mutex_);
+
+            stored_ = value;
+
+            if (!stored_ && watermark_)
+            {
+                successors_.put_watermark(*watermark_);
+                watermark_.reset();
+            }
+        }
+
+        Acc aggregate(const Batch& batch)
+        {
+            auto column = batch.template column<N>();
+            auto acc = init_;
+
+            if (batch.has_selection())
+            {
+                for (auto row : batch.selection())
+                    acc = function_(acc, column[row]);
+            }
+            else
+            {
+                auto size = batch.size();
+                for (std::size_t row = 0; row < size; ++row)
+                    acc = function_(acc, column[row]);
+            }
+
+            return acc;
+        }
+
+        successor_cache<output_type>    successors_;
+        predecessor_cache<input_type>   predecessors_;
+        const Acc                       init_;
+        Function                        function_;
+        boost::optional<output_type>    value_;
+        std::mutex                      mutex_;
+
+        watermark_tracker<input_type>   watermarks_;
+        bool                            stored_;
+        boost::optional<watermark>      watermark_;
+        std::mutex                      watermark_mutex_;
+    };
+
+    template<typename Input, typename Output, typename Generator = std::function<void(pull_type<Input>&, push_type<Output>&)>, typename Coroutines = boost_coroutines>
+    class generator_node final
+        : public receiver<Input>
+        , public sender<Output>
+    {
+    public:
+
+        using source_type = typename Coroutines::template pull_type<input_type>;
+        using sink_type = typename Coroutines::template push_type<output_type>;
+        using generator_type = Generator;
+
+        template<typename Generator>
+        generator_node(executor& executor, Generator&& generator)
+            : executor_(executor)
+            , successors_(this)
+            , predecessors_(this)
+            , output_([&](typename Coroutines::template pull_type<output_type>& source)
+        {
+            for (auto o : source)
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+
+                if (!successors_.try_put(o))
+                    value_ = std::move(o);
+
+                while (value_)
+                    cond_.wait(lock); // NOTE: Cooperative block.
+            }
+        })
+            , generator_([this, generator = std::forward<Generator>(generator)](source_type& source) mutable
+        {
+            suspension_.attach(source);
+            generator(source, output_);
+        })
+            , input_([&](source_type& source)
+        {
+            for (auto i : source)
+            {
+                while (true)
+                {
+                    if (!suspension_.run([&] { generator_(i); }))
+                    {
+                        source(); // NOTE: Back to the executor task, which starts the wait.
+                        continue;
+                    }
+
+                    std::lock_guard<std::mutex> lock(mutex_);
+
+                    active_ = false;
+
+                    if (!predecessors_.try_get(i))
+                    {
+                        idle();
+                        break;
+                    }
+
+                    active_ = true;
+                }
+            }
+        })
+            , active_(false)
+            , busy_(false)
+        {
+        }
+
+        generator_node(const generator_node&) = delete;
+        generator_node(generator_node&&) = delete;
+
+        generator_node& operator=(const generator_node&) = delete;
+        generator_node& operator=(generator_node&&) = delete;
+
+        bool try_put(input_type& i, predecessor_type* s) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (active_ || value_)
+            {
+                predecessors_.add(s);
+
+                return false;
+            }
+
+            active_ = true;
+            {
+                std::lock_guard<std::mutex> watermark_lock(watermark_mutex_);
+
+                busy_ = true;
+            }
+            executor_.run([=]
+            {
+                process(i);
+            });
+
+            return true;
+        }
+
+        bool try_get(output_type& o, successor_type* r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (!value_)
+            {
+                successors_.add(r);
+
+                return false;
+            }
+
+            o = std::move(*value_);
+            value_.reset();
+            cond_.notify_one();
+
+            return true;
+        }
+
+        void register_successor(successor_type& r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            successors_.register_successor(&r);
+        }
+
+        std::size_t pending() override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            return value_ ? 1 : 0;
+        }
+
+        void register_predecessor(predecessor_type& s) override
+        {
+            watermarks_.add(&s);
+        }
+
+        // NOTE: Held back while the generator is running, since it may still emit output for older input.
+        void put_watermark(watermark w, predecessor_type* s) override
+        {
+            if (!watermarks_.update(w, s, w))
+                return;
+
+            std::lock_guard<std::mutex> watermark_lock(watermark_mutex_);
+
+            if (busy_)
+                watermark_ = w;
+            else
+                successors_.put_watermark(w);
+        }
+    private:
+
+        // NOTE: The value passed on resume is ignored; the body picks up where it left off.
+        void process(input_type i)
+        {
+            input_(i);
+
+            if (generator_suspension::suspended())
+            {
+                generator_suspension::start([this, i]
+                {
+                    executor_.run([this, i]
+                    {
+                        process(i);
+                    });
+                });
+            }
+        }
+
+        void idle()
+        {
+            std::lock_guard<std::mutex> watermark_lock(watermark_mutex_);
+
+            busy_ = false;
+
+            if (watermark_)
+            {
+                successors_.put_watermark(*watermark_);
+                watermark_.reset();
+            }
+        }
+
+        using input_sink_type = typename Coroutines::template push_type<input_type>;
+
+        executor&                       executor_;
+        successor_cache<output_type>    successors_;
+        predecessor_cache<input_type>   predecessors_;
+
+        bool                            active_;
+        generator_suspension            suspension_;
+        sink_type                       output_;
+        input_sink_type                 generator_;
+        input_sink_type                 input_;
+
+        boost::optional<output_type>    value_;
+        std::condition_variable         cond_;
+        std::mutex                      mutex_;
+
+        watermark_tracker<input_type>   watermarks_;
+        bool                            busy_;      // NOTE: Mirrors active_ under watermark_mutex_.
+        boost::optional<watermark>      watermark_;
+        std::mutex                      watermark_mutex_;
+    };
+
+    template<typename Input, typename Output, typename Coroutines>
+    using basic_generator_node = generator_node<Input, Output, std::function<void(typename Coroutines::template pull_type<Input>&, typename Coroutines::template push_type<Output>&)>, Coroutines>;
+
+    template<typename Input, typename... Outputs>
+    class multi_generator_node final
+        : public receiver<Input>
+    {
+        template<typename T>
+        class port;
+
+        template<typename T>
+        using owner_ref = multi_generator_node&;
+    public:
+
+        using source_type = pull_type<input_type>;
+        using sinks_type = std::tuple<push_type<Outputs>&...>;
+        using generator_type = std::function<void(source_type&, sinks_type&)>;
+
+        template<std::size_t N>
+        using port_type = port<typename std::tuple_element<N, std::tuple<Outputs...>>::type>;
+
+        template<typename Generator>
+        multi_generator_node(executor& executor, Generator&& generator)
+            : executor_(executor)
+            , predecessors_(this)
+            , active_(false)
+            , ports_(owner_ref<Outputs>(*this)...)
+            , sinks_(make_sinks(std::index_sequence_for<Outputs...>()))
+            , body_(std::forward<Generator>(generator))
+            , generator_([this](source_type& source)
+        {
+            suspension_.attach(source);
+            body_(source, sinks_);
+        })
+            , input_([this](pull_type<input_type>& source)
+        {
+            for (auto i : source)
+            {
+                while (true)
+                {
+                    if (!suspension_.run([&] { generator_(i); }))
+                    {
+                        source(); // NOTE: Back to the executor task, which starts the wait.
+                        continue;
+                    }
+
+                    std::lock_guard<std::mutex> lock(mutex_);
+
+                    active_ = false;
+
+                    if (!predecessors_.try_get(i))
+                    {
+                        idle();
+                        break;
+                    }
+
+                    active_ = true;
+                }
+            }
+        })
+            , busy_(false)
+        {
+        }
+
+        multi_generator_node(const multi_generator_node&) = delete;
+        multi_generator_node(multi_generator_node&&) = delete;
+
+        multi_generator_node& operator=(const multi_generator_node&) = delete;
+        multi_generator_node& operator=(multi_generator_node&&) = delete;
+
+        template<std::size_t N>
+        port_type<N>& output_port()
+        {
+            return std::get<N>(ports_);
+        }
+
+        bool try_put(input_type& i, predecessor_type* s) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (active_ || busy(std::index_sequence_for<Outputs...>()))
+            {
+                predecessors_.add(s);
+
+                return false;
+            }
+
+            active_ = true;
+            {
+                std::lock_guard<std::mutex> watermark_lock(watermark_mutex_);
+
+                busy_ = true;
+            }
+            executor_.run([=]
+            {
+                process(i);
+            });
+
+            return true;
+        }
+
+        void register_predecessor(predecessor_type& s) override
+        {
+            watermarks_.add(&s);
+        }
+
+        // NOTE: Held back while the generator is running, since it may still emit output for older input.
+        //       Every output port receives the input's watermark.
+        void put_watermark(watermark w, predecessor_type* s) override
+        {
+            if (!watermarks_.update(w, s, w))
+                return;
+
+            std::lock_guard<std::mutex> watermark_lock(watermark_mutex_);
+
+            if (busy_)
+                watermark_ = w;
+            else
+                forward_watermark(w, std::index_sequence_for<Outputs...>());
+        }
+    private:
+
+        template<typename T>
+        class port final
+            : public sender<T>
+        {
+        public:
+
+            port(multi_generator_node& owner)
+                : owner_(owner)
+                , successors_(this)
+                , sink_([this](pull_type<output_type>& source)
+            {
+                for (auto o : source)
+                {
+                    std::unique_lock<std::mutex> lock(owner_.mutex_);
+
+                    if (!successors_.try_put(o))
+                        value_ = std::move(o);
+
+                    while (value_)
+                        owner_.cond_.wait(lock); // NOTE: Cooperative block.
+                }
+            })
+            {
+            }
+
+            port(const port&) = delete;
+            port(port&&) = delete;
+
+            port& operator=(const port&) = delete;
+            port& operator=(port&&) = delete;
+
+            bool try_get(output_type& o, successor_type* r) override
+            {
+                std::lock_guard<std::mutex> lock(owner_.mutex_);
+
+                if (!value_)
+                {
+                    successors_.add(r);
+
+                    return false;
+                }
+
+                o = std::move(*value_);
+                value_.reset();
+                owner_.cond_.notify_all();
+
+                return true;
+            }
+
+            void register_successor(successor_type& r) override
+            {
+                std::lock_guard<std::mutex> lock(owner_.mutex_);
+
+                successors_.register_successor(&r);
+            }
+
+            std::size_t pending() override
+            {
+                std::lock_guard<std::mutex> lock(owner_.mutex_);
+
+                return value_ ? 1 : 0;
+            }
+        private:
+            friend class multi_generator_node;
+
+            multi_generator_node&           owner_;
+            successor_cache<output_type>    successors_;
+            boost::optional<output_type>    value_;
+            push_type<output_type>          sink_;
+        };
+
+        template<std::size_t... N>
+        sinks_type make_sinks(std::index_sequence<N...>)
+        {
+            return sinks_type(std::get<N>(ports_).sink_...);
+        }
+
+        // NOTE: The value passed on resume is ignored; the body picks up where it left off.
+        void process(input_type i)
+        {
+            input_(i);
+
+            if (generator_suspension::suspended())
+            {
+                generator_suspension::start([this, i]
+                {
+                    executor_.run([this, i]
+                    {
+                        process(i);
+                    });
+                });
+            }
+        }
+
+        void idle()
+        {
+            std::lock_guard<std::mutex> watermark_lock(watermark_mutex_);
+
+            busy_ = false;
+
+            if (watermark_)
+            {
+                forward_watermark(*watermark_, std::index_sequence_for<Outputs...>());
+                watermark_.reset();
+            }
+        }
+
+        template<std::size_t... N>
+        void forward_watermark(watermark w, std::index_sequence<N...>)
+        {
+            int dummy[] = { 0, (std::get<N>(ports_).successors_.put_watermark(w), 0)... };
+            (void)dummy;
+        }
+
+        template<std::size_t... N>
+        bool busy(std::index_sequence<N...>) const
+        {
+            bool values[] = { false, static_cast<bool>(std::get<N>(ports_).value_)... };
+
+            for (auto value : values)
+            {
+                if (value)
+                    return true;
+            }
+
+            return false;
+        }
+
+        executor&                       executor_;
+        predecessor_cache<input_type>   predecessors_;
+
+        bool                            active_;
+        generator_suspension            suspension_;
+        std::tuple<port<Outputs>...>    ports_;
+        sinks_type                      sinks_;
+        generator_type                  body_;
+        push_type<input_type>           generator_;
+        push_type<input_type>           input_;
+
+        std::condition_variable         cond_;
+        std::mutex                      mutex_;
+
+        watermark_tracker<input_type>   watermarks_;
+        bool                            busy_;      // NOTE: Mirrors active_ under watermark_mutex_.
+        boost::optional<watermark>      watermark_;
+        std::mutex                      watermark_mutex_;
+    };
+
+    // NOTE: Input types must be distinct; the output variant's which() identifies the input port.
+    template<typename... Ts>
+    class indexer_node final
+        : public sender<boost::variant<Ts...>>
+    {
+        template<typename T>
+        class port;
+
+        template<typename T>
+        using owner_ref = indexer_node&;
+    public:
+
+        template<std::size_t N>
+        using port_type = port<typename std::tuple_element<N, std::tuple<Ts...>>::type>;
+
+        indexer_node()
+            : successors_(nullptr)
+            , tail_(nullptr)
+            , ports_(owner_ref<Ts>(*this)...)
+            , watermark_(std::numeric_limits<watermark>::min())
+        {
+        }
+
+        ~indexer_node()
+        {
+            auto successor = successors_.load();
+            while (successor)
+            {
+                auto next = successor->next.load();
+                delete successor;
+                successor = next;
+            }
+        }
+
+        indexer_node(const indexer_node&) = delete;
+        indexer_node(indexer_node&&) = delete;
+
+        indexer_node& operator=(const indexer_node&) = delete;
+        indexer_node& operator=(indexer_node&&) = delete;
+
+        template<std::size_t N>
+        port_type<N>& input_port()
+        {
+            return std::get<N>(ports_);
+        }
+
+        bool try_get(output_type& o, successor_type* r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (try_get(o, std::index_sequence_for<Ts...>()))
+                return true;
+
+            add(r);
+
+            return false;
+        }
+
+        void register_successor(successor_type& r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            add(&r);
+        }
+    private:
+
+        struct successor_entry
+        {
+            successor_entry(successor_type* r)
+                : successor(r)
+                , next(nullptr)
+            {
+            }
+
+            successor_type*                 successor;
+            std::atomic<successor_entry*>   next;
+        };
+
+        template<typename T>
+        class port final
+            : public receiver<T>
+        {
+        public:
+
+            port(indexer_node& owner)
+                : owner_(owner)
+                , predecessors_(this)
+                , watermark_(std::numeric_limits<watermark>::min())
+            {
+            }
+
+            port(const port&) = delete;
+            port(port&&) = delete;
+
+            port& operator=(const port&) = delete;
+            port& operator=(port&&) = delete;
+
+            // NOTE: Forwards without taking the node lock; successors are only ever appended.
+            bool try_put(input_type& i, predecessor_type* s) override
+            {
+                output_type o(std::move(i));
+
+                if (offer(o))
+                    return true;
+
+                std::lock_guard<std::mutex> lock(owner_.mutex_);
+
+                // NOTE: Offer again under the lock; a successor that pulled in between found no predecessor
+                // and now waits for a push.
+                if (offer(o))
+                    return true;
+
+                i = std::move(boost::get<input_type>(o));
+
+                predecessors_.add(s);
+
+                return false;
+            }
+
+            void register_predecessor(predecessor_type& s) override
+            {
+                watermarks_.add(&s);
+            }
+
+            void put_watermark(watermark w, predecessor_type* s) override
+            {
+                if (watermarks_.update(w, s, w))
+                    owner_.advance(watermark_, w);
+            }
+        private:
+            friend class indexer_node;
+
+            using output_type = boost::variant<Ts...>;
+
+            bool offer(output_type& o)
+            {
+                for (auto successor = owner_.successors_.load(std::memory_order_acquire); successor; successor = successor->next.load(std::memory_order_acquire))
+                {
+                    if (successor->successor->try_put(o, &owner_))
+                        return true;
+                }
+
+                return false;
+            }
+
+            indexer_node&                   owner_;
+            predecessor_cache<input_type>   predecessors_;
+            watermark_tracker<input_type>   watermarks_;
+            watermark                       watermark_; // NOTE: Guarded by the owner's watermark_mutex_.
+        };
+
+        template<std::size_t... N>
+        bool try_get(output_type& o, std::index_sequence<N...>)
+        {
+            auto result = false;
+            int dummy[] = { 0, (result = result || try_get_port(o, std::get<N>(ports_)), 0)... };
+            (void)dummy;
+
+            return result;
+        }
+
+        template<typename T>
+        bool try_get_port(output_type& o, port<T>& p)
+        {
+            T i;
+            if (!p.predecessors_.try_get(i))
+                return false;
+
+            o = std::move(i);
+
+            return true;
+        }
+
+        // Forwards the minimum watermark over all input ports once it advances.
+        void advance(watermark& port_watermark, watermark w)
+        {
+            std::lock_guard<std::mutex> watermark_lock(watermark_mutex_);
+
+            port_watermark = w;
+            w = min_watermark(std::index_sequence_for<Ts...>());
+
+            if (w <= watermark_)
+                return;
+
+            watermark_ = w;
+
+            for (auto successor = successors_.load(std::memory_order_acquire); successor; successor = successor->next.load(std::memory_order_acquire))
+                successor->successor->put_watermark(w, this);
+        }
+
+        template<std::size_t... N>
+        watermark min_watermark(std::index_sequence<N...>) const
+        {
+            watermark values[] = { std::get<N>(ports_).watermark_... };
+
+            return *std::min_element(std::begin(values), std::end(values));
+        }
+
+        void add(successor_type* r)
+        {
+            if (!r)
+                return;
+
+            for (auto successor = successors_.load(); successor; successor = successor->next.load())
+            {
+                if (successor->successor == r)
+                    return;
+            }
+
+            auto entry = new successor_entry(r);
+
+            if (tail_)
+                tail_->next.store(entry, std::memory_order_release);
+            else
+                successors_.store(entry, std::memory_order_release);
+
+            tail_ = entry;
+        }
+
+        std::atomic<successor_entry*>   successors_;
+        successor_entry*                tail_;
+        std::tuple<port<Ts>...>         ports_;
+        std::mutex                      mutex_;
+
+        watermark                       watermark_;
+        std::mutex                      watermark_mutex_;
+    };
+
+    template<typename T>
+    class limiter_node final
+        : public receiver<T>
+        , public sender<T>
+    {
+    public:
+
+        limiter_node(std::size_t threshold)
+            : threshold_(threshold)
+            , count_(0)
+            , successors_(this)
+            , predecessors_(this)
+            , decrement_(*this)
+            , stored_(false)
+        {
+        }
+
+        limiter_node(const limiter_node&) = delete;
+        limiter_node(limiter_node&&) = delete;
+
+        limiter_node& operator=(const limiter_node&) = delete;
+        limiter_node& operator=(limiter_node&&) = delete;
+
+        receiver<continue_msg>& decrement()
+        {
+            return decrement_;
+        }
+
+        bool try_put(input_type& i, predecessor_type* s) override
+        {
+            if (try_reserve())
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                if (!value_ && successors_.try_put(i))
+                    return true;
+
+                release();
+                predecessors_.add(s);
+
+                return false;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            // NOTE: Re-check under the lock so a concurrent decrement either sees this predecessor or we see its token.
+            if (!value_ && try_reserve())
+            {
+                if (successors_.try_put(i))
+                    return true;
+
+                release();
+            }
+
+            predecessors_.add(s);
+
+            return false;
+        }
+
+        bool try_get(output_type& o, successor_type* r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (value_)
+            {
+                o = std::move(*value_);
+                value_.reset();
+                stored(false);
+
+                return true;
+            }
+
+            if (try_reserve())
+            {
+                if (predecessors_.try_get(o))
+                    return true;
+
+                release();
+            }
+
+            successors_.add(r);
+
+            return false;
+        }
+
+        void register_successor(successor_type& r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            successors_.register_successor(&r);
+        }
+
+        std::size_t pending() override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            return value_ ? 1 : 0;
+        }
+
+        void register_predecessor(predecessor_type& s) override
+        {
+            watermarks_.add(&s);
+        }
+
+        // NOTE: Held back while an undelivered message is stored.
+        void put_watermark(watermark w, predecessor_type* s) override
+        {
+            if (!watermarks_.update(w, s, w))
+                return;
+
+            std::lock_guard<std::mutex> watermark_lock(watermark_mutex_);
+
+            if (!stored_)
+                successors_.put_watermark(w);
+            else
+                watermark_ = w;
+        }
+    private:
+
+        class decrement_port final
+            : public receiver<continue_msg>
+        {
+        public:
+
+            decrement_port(limiter_node& owner)
+                : owner_(owner)
+            {
+            }
+
+            bool try_put(input_type& i, predecessor_type* s) override
+            {
+                owner_.release();
+                owner_.wake();
+
+                return true;
+            }
+        private:
+            limiter_node& owner_;
+        };
+
+        // NOTE: Mirrors value_ under watermark_mutex_.
+        void stored(bool value)
+        {
+            std::lock_guard<std::mutex> watermark_lock(watermark_mutex_);
+
+            stored_ = value;
+
+            if (!stored_ && watermark_)
+            {
+                successors_.put_watermark(*watermark_);
+                watermark_.reset();
+            }
+        }
+
+        bool try_reserve()
+        {
+            auto count = count_.load(std::memory_order_relaxed);
+            do
+            {
+                if (count >= threshold_)
+                    return false;
+            }
+            while (!count_.compare_exchange_weak(count, count + 1, std::memory_order_acquire, std::memory_order_relaxed));
+
+            return true;
+        }
+
+        void release()
+        {
+            auto count = count_.load(std::memory_order_relaxed);
+            do
+            {
+                if (count == 0)
+                    return;
+            }
+            while (!count_.compare_exchange_weak(count, count - 1, std::memory_order_release, std::memory_order_relaxed));
+        }
+
+        // Hands every returned token to a waiting predecessor in one pass under a single lock acquisition.
+        void wake()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            while (!value_ && try_reserve())
+            {
+                input_type i;
+                if (!predecessors_.try_get(i))
+                {
+                    release();
+                    break;
+                }
+
+                if (!successors_.try_put(i))
+                {
+                    value_ = std::move(i);
+                    stored(true);
+                    break;
+                }
+            }
+        }
+
+        const std::size_t               threshold_;
+        std::atomic<std::size_t>        count_;
+        successor_cache<output_type>    successors_;
+        predecessor_cache<input_type>   predecessors_;
+        boost::optional<output_type>    value_;
+        decrement_port                  decrement_;
+        std::mutex                      mutex_;
+
+        watermark_tracker<T>            watermarks_;
+        bool                            stored_;
+        boost::optional<watermark>      watermark_;
+        std::mutex                      watermark_mutex_;
+    };
+
+    enum class filter_mode
+    {
+        parallel,
+        serial_in_order,
+        serial_out_of_order
+    };
+
+    class flow_control
+    {
+    public:
+
+        flow_control()
+            : stopped_(false)
+        {
+        }
+
+        void stop()
+        {
+            stopped_ = true;
+        }
+
+        bool is_stopped() const
+        {
+            return stopped_;
+        }
+    private:
+        bool stopped_;
+    };
+
+    class pipeline_stage_base
+    {
+    public:
+
+        pipeline_stage_base(filter_mode mode)
+            : mode_(mode)
+            , next_(0)
+        {
+        }
+
+        virtual ~pipeline_stage_base(){}
+
+        // Consumes the item produced by the previous stage and returns the heap allocated item for the next one.
+        // The item is owned (and freed) by process even when it throws. Only the first stage gets a control.
+        virtual void* process(void* item, flow_control* control) = 0;
+
+        virtual void destroy(void* item) = 0;
+
+        // Rewinds the serial_in_order sequence so a new run can start numbering items at 0.
+        void reset()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            next_ = 0;
+        }
+
+        void* run(void* item, std::uint64_t sequence)
+        {
+            switch (mode_)
+            {
+            case filter_mode::parallel:
+                return process(item, nullptr);
+            case filter_mode::serial_out_of_order:
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                return process(item, nullptr);
+            }
+            default:
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+
+                cond_.wait(lock, [&] { return next_ == sequence; }); // NOTE: Cooperative block.
+
+                void* result = nullptr;
+                try
+                {
+                    result = process(item, nullptr);
+                }
+                catch (...)
+                {
+                    advance();
+                    throw;
+                }
+
+                advance();
+
+                return result;
+            }
+            }
+        }
+
+        // Lets a serial_in_order stage move past an item that failed in an earlier stage.
+        void skip(std::uint64_t sequence)
+        {
+            if (mode_ != filter_mode::serial_in_order)
+                return;
+
+            std::unique_lock<std::mutex> lock(mutex_);
+
+            cond_.wait(lock, [&] { return next_ == sequence; }); // NOTE: Cooperative block.
+
+            advance();
+        }
+    private:
+
+        // NOTE: Called with mutex_ held.
+        void advance()
+        {
+            ++next_;
+            cond_.notify_all();
+        }
+
+        const filter_mode           mode_;
+        std::uint64_t               next_;
+        std::condition_variable_any cond_;
+        std::mutex                  mutex_;
+    };
+
+    template<typename Input, typename Output, typename Body>
+    class pipeline_stage_body final
+        : public pipeline_stage_base
+    {
+    public:
+
+        template<typename B>
+        pipeline_stage_body(filter_mode mode, B&& body)
+            : pipeline_stage_base(mode)
+            , body_(std::forward<B>(body))
+        {
+        }
+
+        void* process(void* item, flow_control* control) override
+        {
+            return process(item, control, std::is_void<Input>(), std::is_void<Output>());
+        }
+
+        void destroy(void* item) override
+        {
+            delete static_cast<typename std::conditional<std::is_void<Output>::value, char, Output>::type*>(item);
+        }
+    private:
+
+        void* process(void*, flow_control* control, std::true_type, std::true_type)
+        {
+            ASSERT(control);
+
+            body_(*control);
+
+            return nullptr;
+        }
+
+        void* process(void*, flow_control* control, std::true_type, std::false_type)
+        {
+            ASSERT(control);
+
+            return new Output(body_(*control));
+        }
+
+        void* process(void* item, flow_control*, std::false_type, std::false_type)
+        {
+            std::unique_ptr<Input> input(static_cast<Input*>(item));
+
+            return new Output(body_(std::move(*input)));
+        }
+
+        void* process(void* item, flow_control*, std::false_type, std::true_type)
+        {
+            std::unique_ptr<Input> input(static_cast<Input*>(item));
+
+            body_(std::move(*input));
+
+            return nullptr;
+        }
+
+        Body body_;
+    };
+
+    template<typename Input, typename Output>
+    class pipeline_stage
+    {
+    public:
+
+        explicit pipeline_stage(std::vector<std::shared_ptr<pipeline_stage_base>> stages)
+            : stages_(std::move(stages))
+        {
+        }
+
+        const std::vector<std::shared_ptr<pipeline_stage_base>>& stages() const
+        {
+            return stages_;
+        }
+    private:
+        std::vector<std::shared_ptr<pipeline_stage_base>> stages_;
+    };
+
+    // NOTE: The first stage (Input = void) receives a flow_control and is always run serially.
+    template<typename Input, typename Output, typename Body>
+    pipeline_stage<Input, Output> make_stage(filter_mode mode, Body&& body)
+    {
+        using body_type = typename std::decay<Body>::type;
+
+        return pipeline_stage<Input, Output>({ std::make_shared<pipeline_stage_body<Input, Output, body_type>>(mode, std::forward<Body>(body)) });
+    }
+
+    template<typename Input, typename Middle, typename Output>
+    pipeline_stage<Input, Output> operator&(const pipeline_stage<Input, Middle>& lhs, const pipeline_stage<Middle, Output>& rhs)
+    {
+        static_assert(!std::is_void<Middle>::value, "Only the first stage may take no input.");
+
+        auto stages = lhs.stages();
+        stages.insert(stages.end(), rhs.stages().begin(), rhs.stages().end());
+
+        return pipeline_stage<Input, Output>(std::move(stages));
+    }
+
+    // Runs items depth-first through all stages on the executor, with at most max_tokens items alive at once.
+    // If a stage throws, no further items are started, the items in flight drain, and the first exception
+    // is rethrown once every token has finished.
+    // NOTE: A pipeline may be run again once the previous run has returned, but not concurrently with itself.
+    inline void parallel_pipeline(executor& executor, std::size_t max_tokens, const pipeline_stage<void, void>& pipeline)
+    {
+        auto& stages = pipeline.stages();
+
+        ASSERT(!stages.empty());
+        ASSERT(max_tokens > 0);
+
+        for (auto& stage : stages)
+            stage->reset();
+
+        std::mutex                  input_mutex;
+        std::uint64_t               sequence = 0;
+        bool                        stopped = false;
+
+        std::mutex                  wait_mutex;
+        std::condition_variable_any wait_cond;
+        std::size_t                 running = max_tokens;
+        std::exception_ptr          error;
+
+        auto fail = [&]
+        {
+            {
+                std::lock_guard<std::mutex> lock(input_mutex);
+
+                stopped = true;
+            }
+
+            std::lock_guard<std::mutex> lock(wait_mutex);
+
+            if (!error)
+                error = std::current_exception();
+        };
+
+        for (std::size_t n = 0; n < max_tokens; ++n)
+        {
+            executor.run([&]
+            {
+                while (true)
+                {
+                    void* item = nullptr;
+                    std::uint64_t item_sequence = 0;
+                    try
+                    {
+                        std::lock_guard<std::mutex> lock(input_mutex);
+
+                        if (stopped)
+                            break;
+
+                        flow_control control;
+                        item = stages.front()->process(nullptr, &control);
+
+                        if (control.is_stopped())
+                        {
+                            stages.front()->destroy(item);
+                            stopped = true;
+                            break;
+                        }
+
+                        item_sequence = sequence++;
+                    }
+                    catch (...)
+                    {
+                        fail();
+                        break;
+                    }
+
+                    std::size_t s = 1;
+                    try
+                    {
+                        for (; s < stages.size(); ++s)
+                            item = stages[s]->run(item, item_sequence);
+                    }
+                    catch (...)
+                    {
+                        fail();
+
+                        // NOTE: The item died with the stage that threw; later stages must still see its sequence.
+                        while (++s < stages.size())
+                            stages[s]->skip(item_sequence);
+                    }
+                }
+
+                std::lock_guard<std::mutex> lock(wait_mutex);
+
+                --running;
+                wait_cond.notify_one();
+            });
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(wait_mutex);
+            wait_cond.wait(lock, [&] { return running == 0; }); // NOTE: Cooperative block.
+        }
+
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    // Fires its body once a signal has arrived from every predecessor attached with make_edge, and
+    // broadcasts the result. Nothing is buffered; a node without predecessors fires on every signal.
+    template<typename Output = continue_msg>
+    class continue_node final
+        : public receiver<continue_msg>
+        , public sender<Output>
+    {
+    public:
+
+        using body_type = std::function<Output(const continue_msg&)>;
+
+        template<typename Body>
+        continue_node(executor& executor, Body&& body)
+            : executor_(executor)
+            , body_(std::forward<Body>(body))
+            , predecessor_count_(0)
+            , remaining_(0)
+            , running_(0)
+        {
+        }
+
+        continue_node(const continue_node&) = delete;
+        continue_node(continue_node&&) = delete;
+
+        continue_node& operator=(const continue_node&) = delete;
+        continue_node& operator=(continue_node&&) = delete;
+
+        void register_predecessor(predecessor_type& s) override
+        {
+            ++predecessor_count_;
+            ++remaining_;
+
+            watermarks_.add(&s);
+        }
+
+        bool try_put(input_type& i, predecessor_type* s) override
+        {
+            auto count = predecessor_count_.load();
+
+            if (count > 0)
+            {
+                if (--remaining_ != 0)
+                    return true;
+
+                remaining_ += count;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                ++running_;
+            }
+
+            executor_.run([this]
+            {
+                auto o = body_(continue_msg());
+
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                for (auto successor : successors_)
+                {
+                    auto o2 = o;
+                    successor->try_put(o2, nullptr);
+                }
+
+                if (--running_ == 0 && watermark_)
+                {
+                    forward_watermark(*watermark_);
+                    watermark_.reset();
+                }
+            });
+
+            return true;
+        }
+
+        bool try_get(output_type& o, successor_type* r) override
+        {
+            return false;
+        }
+
+        void register_successor(successor_type& r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            successors_.push_back(&r);
+        }
+
+        // NOTE: Held back while a body is running, since its result belongs to older signals.
+        void put_watermark(watermark w, predecessor_type* s) override
+        {
+            if (!watermarks_.update(w, s, w))
+                return;
+
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (running_ == 0)
+                forward_watermark(w);
+            else
+                watermark_ = w;
+        }
+    private:
+
+        void forward_watermark(watermark w)
+        {
+            for (auto successor : successors_)
+                successor->put_watermark(w, this);
+        }
+
+        executor&                       executor_;
+        body_type                       body_;
+        std::atomic<int>                predecessor_count_;
+        std::atomic<int>                remaining_;
+        std::vector<successor_type*>    successors_;
+        std::size_t                     running_;
+        watermark_tracker<continue_msg> watermarks_;
+        boost::optional<watermark>      watermark_;
+        std::mutex                      mutex_;
+    };
+
+    // One T per worker thread, each in its own cache line aligned slot. The owning thread's updates only
+    // ever touch its own slot (its lock is uncontended); combine_each visits every slot, e.g. on flush.
+    template<typename T>
+    class worker_local
+    {
+    public:
+
+        worker_local()
+            : worker_local([] { return T(); })
+        {
+        }
+
+        template<typename Init>
+        explicit worker_local(Init&& init)
+            : init_(std::forward<Init>(init))
+            , slots_([this] { return create(); })
+        {
+        }
+
+        worker_local(const worker_local&) = delete;
+        worker_local(worker_local&&) = delete;
+
+        worker_local& operator=(const worker_local&) = delete;
+        worker_local& operator=(worker_local&&) = delete;
+
+        template<typename F>
+        void local(F&& f)
+        {
+            auto s = slots_.local();
+
+            std::lock_guard<std::mutex> lock(s->mutex);
+
+            f(s->value);
+        }
+
+        template<typename F>
+        void combine_each(F&& f)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            for (auto& s : all_)
+            {
+                std::lock_guard<std::mutex> slot_lock(s->mutex);
+
+                f(s->value);
+            }
+        }
+    private:
+
+        struct slot
+            : cache_aligned
+        {
+            slot(T v)
+                : value(std::move(v))
+            {
+            }
+
+            std::mutex  mutex;
+            T           value;
+        };
+
+        slot* create()
+        {
+            std::unique_ptr<slot> s(new slot(init_()));
+
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            all_.push_back(std::move(s));
+
+            return all_.back().get();
+        }
+
+        std::function<T()>                  init_;
+        std::vector<std::unique_ptr<slot>>  all_;
+        std::mutex                          mutex_;
+        concurrency::combinable<slot*>      slots_;
+    };
+
+    // Accumulates into per-worker partials and only merges them when flushed, either by calling flush()
+    // or by signalling flush_port() at end of stream. Each flush emits the merged Acc and resets the partials.
+    template<typename T, typename Acc>
+    class aggregate_node final
+        : public receiver<T>
+        , public sender<Acc>
+    {
+    public:
+        using init_type = std::function<Acc()>;
+        using accumulate_type = std::function<void(Acc&, const T&)>;
+        using merge_type = std::function<void(Acc&, const Acc&)>;
+
+        template<typename Init, typename Accumulate, typename Merge>
+        aggregate_node(Init&& init, Accumulate&& accumulate, Merge&& merge)
+            : init_(std::forward<Init>(init))
+            , accumulate_(std::forward<Accumulate>(accumulate))
+            , merge_(std::forward<Merge>(merge))
+            , partials_(init_)
+            , successors_(this)
+            , flush_(*this)
+        {
+        }
+
+        aggregate_node(const aggregate_node&) = delete;
+        aggregate_node(aggregate_node&&) = delete;
+
+        aggregate_node& operator=(const aggregate_node&) = delete;
+        aggregate_node& operator=(aggregate_node&&) = delete;
+
+        receiver<continue_msg>& flush_port()
+        {
+            return flush_;
+        }
+
+        void flush()
+        {
+            auto result = init_();
+
+            partials_.combine_each([&](Acc& partial)
+            {
+                merge_(result, partial);
+                partial = init_();
+            });
+
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (!queue_.empty() || !successors_.try_put(result))
+                queue_.push(std::move(result));
+        }
+
+        bool try_put(input_type& i, predecessor_type* s) override
+        {
+            partials_.local([&](Acc& partial)
+            {
+                accumulate_(partial, i);
+            });
+
+            return true;
+        }
+
+        bool try_get(output_type& o, successor_type* r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (queue_.empty())
+            {
+                successors_.add(r);
+
+                return false;
+            }
+
+            o = std::move(queue_.front());
+            queue_.pop();
+
+            return true;
+        }
+
+        void register_successor(successor_type& r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            successors_.register_successor(&r);
+        }
+
+        std::size_t pending() override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            return queue_.size();
+        }
+
+        void register_predecessor(predecessor_type& s) override
+        {
+            watermarks_.add(&s);
+        }
+
+        // NOTE: end_of_stream flushes the partials before it is passed on.
+        void put_watermark(watermark w, predecessor_type* s) override
+        {
+            if (!watermarks_.update(w, s, w))
+                return;
+
+            if (w == end_of_stream)
+                flush();
+
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            successors_.put_watermark(w);
+        }
+    private:
+
+        class flush_port_type final
+            : public receiver<continue_msg>
+        {
+        public:
+
+            flush_port_type(aggregate_node& owner)
+                : owner_(owner)
+            {
+            }
+
+            bool try_put(input_type& i, predecessor_type* s) override
+            {
+                owner_.flush();
+
+                return true;
+            }
+        private:
+            aggregate_node& owner_;
+        };
+
+        init_type                       init_;
+        accumulate_type                 accumulate_;
+        merge_type                      merge_;
+        worker_local<Acc>               partials_;
+        successor_cache<output_type>    successors_;
+        std::queue<output_type>         queue_;
+        flush_port_type                 flush_;
+        watermark_tracker<T>            watermarks_;
+        std::mutex                      mutex_;
+    };
+
+    enum class window_kind
+    {
+        tumbling,
+        sliding,
+        session
+    };
+
+    // Times are in the units returned by the node's time function (e.g. milliseconds since epoch).
+    struct window_spec
+    {
+        static window_spec tumbling(std::int64_t size)
+        {
+            return window_spec{ window_kind::tumbling, size, size, 0 };
+        }
+
+        static window_spec sliding(std::int64_t size, std::int64_t slide)
+        {
+            return window_spec{ window_kind::sliding, size, slide, 0 };
+        }
+
+        static window_spec session(std::int64_t gap)
+        {
+            return window_spec{ window_kind::session, 0, 0, gap };
+        }
+
+        window_kind     kind;
+        std::int64_t    size;
+        std::int64_t    slide;
+        std::int64_t    gap;
+    };
+
+    template<typename Key, typename Result>
+    struct window_result
+    {
+        Key             key;
+        std::int64_t    start;
+        std::int64_t    end;
+        Result          value;
+    };
+
+    // Aggregates for window_node: init/add/merge/result over a mergeable state_type.
+    struct window_count
+    {
+        using state_type = std::uint64_t;
+        using result_type = std::uint64_t;
+
+        state_type init() const
+        {
+            return 0;
+        }
+
+        template<typename T>
+        void add(state_type& state, const T&) const
+        {
+            ++state;
+        }
+
+        void merge(state_type& state, const state_type& other) const
+        {
+            state += other;
+        }
+
+        result_type result(const state_type& state) const
+        {
+            return state;
+        }
+    };
+
+    template<typename ValueFn>
+    struct window_average
+    {
+        struct state_type
+        {
+            double          sum;
+            std::uint64_t   count;
+        };
+
+        using result_type = double;
+
+        window_average(ValueFn value = ValueFn())
+            : value_(std::move(value))
+        {
+        }
+
+        state_type init() const
+        {
+            return state_type{ 0.0, 0 };
+        }
+
+        template<typename T>
+        void add(state_type& state, const T& v) const
+        {
+            state.sum += static_cast<double>(value_(v));
+            ++state.count;
+        }
+
+        void merge(state_type& state, const state_type& other) const
+        {
+            state.sum += other.sum;
+            state.count += other.count;
+        }
+
+        result_type result(const state_type& state) const
+        {
+            return state.count > 0 ? state.sum / state.count : 0.0;
+        }
+    private:
+        ValueFn value_;
+    };
+
+    // Groups messages by key into tumbling, sliding or session windows of event time and emits one
+    // window_result per key and window once time has advanced past the window's end. Sliding windows are
+    // kept as panes of gcd(size, slide) so each message is aggregated once and overlapping windows only
+    // merge pane states. Per-key state lives in an arena that reuses the nodes of fired windows and is
+    // released whenever all windows have fired.
+    template<typename T, typename KeyFn, typename Agg>
+    class window_node final
+        : public receiver<T>
+        , public sender<window_result<typename std::decay<decltype(std::declval<KeyFn&>()(std::declval<const T&>()))>::type, typename Agg::result_type>>
+    {
+    public:
+        using key_type = typename std::decay<decltype(std::declval<KeyFn&>()(std::declval<const T&>()))>::type;
+        using time_type = std::function<std::int64_t(const T&)>;
+
+        template<typename TimeFn>
+        window_node(window_spec spec, KeyFn key, TimeFn&& time, Agg agg = Agg())
+            : spec_(spec)
+            , pane_(spec.kind == window_kind::session ? 0 : gcd(spec.size, spec.slide))
+            , key_(std::move(key))
+            , time_(std::forward<TimeFn>(time))
+            , agg_(std::move(agg))
+            , fired_(false)
+            , fired_until_(0)
+            , successors_(this)
+        {
+            reset();
+        }
+
+        window_node(const window_node&) = delete;
+        window_node(window_node&&) = delete;
+
+        window_node& operator=(const window_node&) = delete;
+        window_node& operator=(window_node&&) = delete;
+
+        // Fires windows on processing time, using the system clock in milliseconds since epoch.
+        void fire_every(executor& executor, std::chrono::milliseconds period)
+        {
+            timer_.reset(new periodic_timer(executor, period, [this]
+            {
+                advance(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+            }));
+        }
+
+        // Fires every window that ends at or before time. Later messages for those windows are dropped.
+        void advance(std::int64_t time)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (spec_.kind == window_kind::session)
+                fire_sessions(time);
+            else
+                fire_panes(time);
+
+            if (keys_->empty())
+                reset();
+        }
+
+        bool try_put(input_type& i, predecessor_type* s) override
+        {
+            auto time = time_(i);
+            auto key = key_(i);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (spec_.kind == window_kind::session)
+                add_session(key, time, i);
+            else
+                add_pane(key, time, i);
+
+            return true;
+        }
+
+        bool try_get(output_type& o, successor_type* r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (queue_.empty())
+            {
+                successors_.add(r);
+
+                return false;
+            }
+
+            o = std::move(queue_.front());
+            queue_.pop();
+
+            return true;
+        }
+
+        void register_successor(successor_type& r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            successors_.register_successor(&r);
+        }
+
+        std::size_t pending() override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            return queue_.size();
+        }
+
+        void register_predecessor(predecessor_type& s) override
+        {
+            watermarks_.add(&s);
+        }
+
+        // Fires every window the watermark has passed, then passes the watermark on.
+        void put_watermark(watermark w, predecessor_type* s) override
+        {
+            if (!watermarks_.update(w, s, w))
+                return;
+
+            advance(w);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            successors_.put_watermark(w);
+        }
+    private:
+        using state_type = typename Agg::state_type;
+
+        struct session
+        {
+            std::int64_t    end;
+            state_type      state;
+        };
+
+        template<typename V>
+        using ordered_map = std::map<std::int64_t, V, std::less<std::int64_t>, arena_allocator<std::pair<const std::int64_t, V>>>;
+
+        struct key_state
+        {
+            explicit key_state(arena& a)
+                : panes(std::less<std::int64_t>(), arena_allocator<std::pair<const std::int64_t, state_type>>(a))
+                , sessions(std::less<std::int64_t>(), arena_allocator<std::pair<const std::int64_t, session>>(a))
+            {
+            }
+
+            ordered_map<state_type> panes;      // NOTE: Keyed by pane start.
+            ordered_map<session>    sessions;   // NOTE: Keyed by session start.
+        };
+
+        using key_map = std::unordered_map<key_type, key_state, std::hash<key_type>, std::equal_to<key_type>, arena_allocator<std::pair<const key_type, key_state>>>;
+
+        static std::int64_t gcd(std::int64_t a, std::int64_t b)
+        {
+            while (b != 0)
+            {
+                auto t = a % b;
+                a = b;
+                b = t;
+            }
+            return a;
+        }
+
+        // NOTE: Saturates so end_of_stream can be used as a time.
+        static std::int64_t add(std::int64_t time, std::int64_t step)
+        {
+            return time > std::numeric_limits<std::int64_t>::max() - step ? std::numeric_limits<std::int64_t>::max() : time + step;
+        }
+
+        static std::int64_t floor_to(std::int64_t time, std::int64_t step)
+        {
+            auto r = time % step;
+            return r < 0 ? time - r - step : time - r;
+        }
+
+        key_state& state_for(const key_type& key)
+        {
+            auto it = keys_->find(key);
+            if (it == keys_->end())
+                it = keys_->emplace(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple(arena_)).first;
+
+            return it->second;
+        }
+
+        void add_pane(const key_type& key, std::int64_t time, const T& v)
+        {
+            auto start = floor_to(time, pane_);
+
+            // NOTE: Every window containing this pane has already fired.
+            if (fired_ && start + spec_.size <= fired_until_)
+                return;
+
+            auto& panes = state_for(key).panes;
+
+            auto it = panes.find(start);
+            if (it == panes.end())
+                it = panes.emplace(start, agg_.init()).first;
+
+            agg_.add(it->second, v);
+        }
+
+        void fire_panes(std::int64_t time)
+        {
+            auto last = floor_to(time, spec_.slide);
+
+            auto end = fired_ ? add(fired_until_, spec_.slide) : next_end(last);
+            while (!keys_->empty() && end <= last)
+            {
+                auto start = end - spec_.size;
+
+                for (auto it = keys_->begin(); it != keys_->end();)
+                {
+                    auto& panes = it->second.panes;
+
+                    auto state = agg_.init();
+                    auto any = false;
+                    for (auto p = panes.lower_bound(start); p != panes.end() && p->first < end; ++p)
+                    {
+                        agg_.merge(state, p->second);
+                        any = true;
+                    }
+
+                    if (any)
+                        emit(it->first, start, end, state);
+
+                    // NOTE: Panes before the next window's start can't contribute to any later window.
+                    panes.erase(panes.begin(), panes.lower_bound(add(end, spec_.slide) - spec_.size));
+
+                    if (panes.empty())
+                        it = keys_->erase(it);
+                    else
+                        ++it;
+                }
+
+                if (end == std::numeric_limits<std::int64_t>::max())
+                    break;
+
+                // NOTE: Skip stretches without data instead of stepping through every empty window.
+                end = std::max(add(end, spec_.slide), next_end(add(last, spec_.slide)));
+            }
+
+            if (!fired_ || last > fired_until_)
+            {
+                fired_until_ = last;
+                fired_ = true;
+            }
+        }
+
+        // The end of the first window containing the oldest pane, or limit if there are no panes.
+        std::int64_t next_end(std::int64_t limit)
+        {
+            auto result = limit;
+            for (auto& k : *keys_)
+            {
+                if (!k.second.panes.empty())
+                    result = std::min(result, floor_to(k.second.panes.begin()->first, spec_.slide) + spec_.slide);
+            }
+            return result;
+        }
+
+        void add_session(const key_type& key, std::int64_t time, const T& v)
+        {
+            if (fired_ && time + spec_.gap <= fired_until_)
+                return;
+
+            auto& sessions = state_for(key).sessions;
+
+            auto start = time;
+            auto end = time + spec_.gap;
+            auto state = agg_.init();
+            agg_.add(state, v);
+
+            // NOTE: Merge every session overlapping [start, end) into the new one.
+            auto it = sessions.upper_bound(end);
+            while (it != sessions.begin())
+            {
+                auto prev = std::prev(it);
+                if (prev->second.end < start)
+                    break;
+
+                start = std::min(start, prev->first);
+                end = std::max(end, prev->second.end);
+                agg_.merge(state, prev->second.state);
+                it = sessions.erase(prev);
+            }
+
+            sessions.emplace(start, session{ end, std::move(state) });
+        }
+
+        void fire_sessions(std::int64_t time)
+        {
+            for (auto it = keys_->begin(); it != keys_->end();)
+            {
+                auto& sessions = it->second.sessions;
+
+                for (auto s = sessions.begin(); s != sessions.end();)
+                {
+                    if (s->second.end <= time)
+                    {
+                        emit(it->first, s->first, s->second.end, s->second.state);
+                        s = sessions.erase(s);
+                    }
+                    else
+                        ++s;
+                }
+
+                if (sessions.empty())
+                    it = keys_->erase(it);
+                else
+                    ++it;
+            }
+
+            if (!fired_ || time > fired_until_)
+            {
+                fired_until_ = time;
+                fired_ = true;
+            }
+        }
+
+        void emit(const key_type& key, std::int64_t start, std::int64_t end, const state_type& state)
+        {
+            output_type o{ key, start, end, agg_.result(state) };
+
+            if (!queue_.empty() || !successors_.try_put(o))
+                queue_.push(std::move(o));
+        }
+
+        void reset()
+        {
+            keys_.reset();
+            arena_.reset();
+            keys_.reset(new key_map(16, std::hash<key_type>(), std::equal_to<key_type>(), arena_allocator<std::pair<const key_type, key_state>>(arena_)));
+        }
+
+        const window_spec               spec_;
+        const std::int64_t              pane_;
+        KeyFn                           key_;
+        time_type                       time_;
+        Agg                             agg_;
+        bool                            fired_;
+        std::int64_t                    fired_until_;
+
+        arena                           arena_;
+        std::unique_ptr<key_map>        keys_;
+
+        successor_cache<output_type>    successors_;
+        std::queue<output_type>         queue_;
+        watermark_tracker<T>            watermarks_;
+        std::mutex                      mutex_;
+        std::unique_ptr<periodic_timer> timer_; // NOTE: Declared last so it stops before the state it fires on is destroyed.
+    };
+
+    // Spreads std::hash results (often the identity for integers) over all 64 bits.
+    inline std::uint64_t mix_hash(std::uint64_t h)
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+
+        return h;
+    }
+
+    inline void prefetch(const void* p)
+    {
+#if defined(_MSC_VER)
+        _mm_prefetch(static_cast<const char*>(p), _MM_HINT_T0);
+#else
+        __builtin_prefetch(p);
+#endif
+    }
+
+    enum class join_mode
+    {
+        build_probe,    // NOTE: Right is the build side and keeps the latest value per key; left probes it.
+        symmetric       // NOTE: Both sides are kept and every message probes the other side.
+    };
+
+    // Open addressing (linear probing) hash table split into independently locked partitions. The caller
+    // locks partition(hash) around insert/find; slots stores the probe array for lock-free prefetching.
+    // Given a time function, each partition also keeps its values in a min-heap by time for evict().
+    template<typename Key, typename Value>
+    class join_table
+    {
+        struct expiry
+        {
+            watermark       time;
+            std::uint64_t   hash;
+            std::uint64_t   id;
+
+            bool operator>(const expiry& other) const
+            {
+                return time > other.time;
+            }
+        };
+
+        using expiry_heap = std::priority_queue<expiry, std::vector<expiry>, std::greater<expiry>>;
+    public:
+
+        using time_type = std::function<watermark(const Value&)>;
+
+        struct partition
+        {
+            partition()
+                : size(0)
+                , next_id(0)
+                , slots(nullptr)
+                , mask(0)
+            {
+            }
+
+            std::vector<std::uint64_t>                  hashes; // NOTE: 0 marks an empty slot.
+            std::vector<Key>                            keys;
+            std::vector<Value>                          values;
+            std::vector<std::uint64_t>                  ids;    // NOTE: Tell a value from one that replaced it.
+            std::size_t                                 size;
+            std::uint64_t                               next_id;
+            expiry_heap                                 expiries;
+            std::atomic<const std::uint64_t*>           slots;
+            std::atomic<std::size_t>                    mask;
+            std::mutex                                  mutex;
+        };
+
+        explicit join_table(std::size_t partitions, time_type time = time_type())
+            : partitions_(partitions)
+            , shift_(64)
+            , time_(std::move(time))
+        {
+            ASSERT(partitions > 0 && (partitions & (partitions - 1)) == 0);
+
+            for (auto n = partitions; n > 1; n >>= 1)
+                --shift_;
+        }
+
+        static std::uint64_t hash_of(const Key& key)
+        {
+            return mix_hash(std::hash<Key>()(key)) | 1;
+        }
+
+        partition& partition_of(std::uint64_t hash)
+        {
+            return partitions_[shift_ < 64 ? hash >> shift_ : 0];
+        }
+
+        // NOTE: May point at a stale probe array while the partition grows; prefetching it is harmless.
+        void prefetch_slot(std::uint64_t hash)
+        {
+            auto& p = partition_of(hash);
+
+            auto slots = p.slots.load(std::memory_order_relaxed);
+            if (slots)
+                prefetch(slots + (hash & p.mask.load(std::memory_order_relaxed)));
+        }
+
+        void insert(partition& p, std::uint64_t hash, const Key& key, const Value& value, bool replace)
+        {
+            if ((p.size + 1) * 2 > p.hashes.size())
+                grow(p);
+
+            auto mask = p.hashes.size() - 1;
+            for (auto idx = hash & mask; ; idx = (idx + 1) & mask)
+            {
+                if (p.hashes[idx] == 0)
+                {
+                    p.hashes[idx] = hash;
+                    p.keys[idx] = key;
+                    ++p.size;
+                }
+                else if (!replace || p.hashes[idx] != hash || !(p.keys[idx] == key))
+                    continue;
+
+                // NOTE: A replaced value's expiry goes stale; evict() drops it once it finds no matching id.
+                p.values[idx] = value;
+                p.ids[idx] = p.next_id++;
+
+                if (time_)
+                    p.expiries.push(expiry{ time_(value), hash, p.ids[idx] });
+
+                return;
+            }
+        }
+
+        template<typename F>
+        void find(partition& p, std::uint64_t hash, const Key& key, F&& f)
+        {
+            if (p.hashes.empty())
+                return;
+
+            auto mask = p.hashes.size() - 1;
+            for (auto idx = hash & mask; p.hashes[idx] != 0; idx = (idx + 1) & mask)
+            {
+                if (p.hashes[idx] == hash && p.keys[idx] == key)
+                    f(p.values[idx]);
+            }
+        }
+
+        // Removes every value whose time is before limit, locking one partition at a time. Values leave each
+        // partition's heap in time order, so this only visits what expired (and stale expiries of replaced values).
+        void evict(watermark limit)
+        {
+            for (auto& p : partitions_)
+            {
+                std::lock_guard<std::mutex> lock(p.mutex);
+
+                while (!p.expiries.empty() && p.expiries.top().time < limit)
+                {
+                    auto e = p.expiries.top();
+                    p.expiries.pop();
+
+                    auto mask = p.hashes.size() - 1;
+                    for (auto idx = e.hash & mask; p.hashes[idx] != 0; idx = (idx + 1) & mask)
+                    {
+                        if (p.hashes[idx] == e.hash && p.ids[idx] == e.id)
+                        {
+                            erase(p, idx);
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+    private:
+
+        // NOTE: Linear probing can't leave holes in a probe sequence, so the entries after idx that probed
+        // past it are shifted back into the hole (backward shift deletion).
+        void erase(partition& p, std::size_t idx)
+        {
+            auto mask = p.hashes.size() - 1;
+            for (auto next = (idx + 1) & mask; p.hashes[next] != 0; next = (next + 1) & mask)
+            {
+                // NOTE: Moving is only allowed if the entry's home slot doesn't lie in (idx, next].
+                if (((next - (p.hashes[next] & mask)) & mask) < ((next - idx) & mask))
+                    continue;
+
+                p.hashes[idx] = p.hashes[next];
+                p.keys[idx] = std::move(p.keys[next]);
+                p.values[idx] = std::move(p.values[next]);
+                p.ids[idx] = p.ids[next];
+                idx = next;
+            }
+
+            p.hashes[idx] = 0;
+            p.keys[idx] = Key();
+            p.values[idx] = Value();
+            --p.size;
+        }
+
+        void grow(partition& p)
+        {
+            auto capacity = std::max<std::size_t>(16, p.hashes.size() * 2);
+
+            std::vector<std::uint64_t> hashes(capacity, 0);
+            std::vector<Key> keys(capacity);
+            std::vector<Value> values(capacity);
+            std::vector<std::uint64_t> ids(capacity);
+
+            auto mask = capacity - 1;
+            for (std::size_t n = 0; n < p.hashes.size(); ++n)
+            {
+                if (p.hashes[n] == 0)
+                    continue;
+
+                auto idx = p.hashes[n] & mask;
+                while (hashes[idx] != 0)
+                    idx = (idx + 1) & mask;
+
+                hashes[idx] = p.hashes[n];
+                keys[idx] = std::move(p.keys[n]);
+                values[idx] = std::move(p.values[n]);
+                ids[idx] = p.ids[n];
+            }
+
+            p.hashes.swap(hashes);
+            p.keys.swap(keys);
+            p.values.swap(values);
+            p.ids.swap(ids);
+
+            p.slots.store(p.hashes.data(), std::memory_order_relaxed);
+            p.mask.store(mask, std::memory_order_relaxed);
+        }
+
+        std::vector<partition>  partitions_;
+        unsigned                shift_;
+        const time_type         time_;
+    };
+
+    // Inner equi-join of two streams, emitting std::pair<L, R> for every match. Left messages can also be
+    // sent in batches through left_batch_port(); batches probe with software prefetching. The node forwards
+    // the minimum watermark of its connected inputs. Given event time functions and a retention, stored
+    // messages older than that watermark minus the retention are evicted, so only pairs whose times lie
+    // within the retention of each other are guaranteed to match; without them both tables grow unbounded.
+    template<typename L, typename R, typename Key>
+    class hash_join_node final
+        : public sender<std::pair<L, R>>
+    {
+        template<typename T>
+        class port;
+    public:
+        using left_key_type = std::function<Key(const L&)>;
+        using right_key_type = std::function<Key(const R&)>;
+        using left_time_type = std::function<watermark(const L&)>;
+        using right_time_type = std::function<watermark(const R&)>;
+
+        template<typename LeftKey, typename RightKey>
+        hash_join_node(join_mode mode, LeftKey&& left_key, RightKey&& right_key, std::size_t partitions = 16)
+            : hash_join_node(mode, std::forward<LeftKey>(left_key), std::forward<RightKey>(right_key), left_time_type(), right_time_type(), 0, partitions)
+        {
+        }
+
+        template<typename LeftKey, typename RightKey, typename LeftTime, typename RightTime>
+        hash_join_node(join_mode mode, LeftKey&& left_key, RightKey&& right_key, LeftTime&& left_time, RightTime&& right_time, watermark retention, std::size_t partitions = 16)
+            : mode_(mode)
+            , left_key_(std::forward<LeftKey>(left_key))
+            , right_key_(std::forward<RightKey>(right_key))
+            , left_time_(std::forward<LeftTime>(left_time))
+            , right_time_(std::forward<RightTime>(right_time))
+            , retention_(retention)
+            , left_(partitions, left_time_ && right_time_ ? left_time_ : left_time_type())
+            , right_(partitions, left_time_ && right_time_ ? right_time_ : right_time_type())
+            , left_port_(*this, &hash_join_node::put_left)
+            , right_port_(*this, &hash_join_node::put_right)
+            , left_batch_port_(*this, &hash_join_node::put_left_batch)
+            , successors_(this)
+            , watermark_(std::numeric_limits<watermark>::min())
+        {
+            ASSERT(retention >= 0);
+        }
+
+        hash_join_node(const hash_join_node&) = delete;
+        hash_join_node(hash_join_node&&) = delete;
+
+        hash_join_node& operator=(const hash_join_node&) = delete;
+        hash_join_node& operator=(hash_join_node&&) = delete;
+
+        receiver<L>& left_port()
+        {
+            return left_port_;
+        }
+
+        receiver<R>& right_port()
+        {
+            return right_port_;
+        }
+
+        receiver<std::vector<L>>& left_batch_port()
+        {
+            return left_batch_port_;
+        }
+
+        bool try_get(output_type& o, successor_type* r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (queue_.empty())
+            {
+                successors_.add(r);
+
+                return false;
+            }
+
+            o = std::move(queue_.front());
+            queue_.pop();
+
+            if (queue_.empty() && held_watermark_)
+            {
+                successors_.put_watermark(*held_watermark_);
+                held_watermark_.reset();
+            }
+
+            return true;
+        }
+
+        void register_successor(successor_type& r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            successors_.register_successor(&r);
+        }
+
+        std::size_t pending() override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            return queue_.size();
+        }
+    private:
+
+        template<typename T>
+        class port final
+            : public receiver<T>
+        {
+        public:
+            using handler_type = void (hash_join_node::*)(T&);
+
+            port(hash_join_node& owner, handler_type handler)
+                : owner_(owner)
+                , handler_(handler)
+                , connected_(false)
+                , watermark_(std::numeric_limits<watermark>::min())
+            {
+            }
+
+            bool try_put(input_type& i, predecessor_type* s) override
+            {
+                (owner_.*handler_)(i);
+
+                return true;
+            }
+
+            void register_predecessor(predecessor_type& s) override
+            {
+                {
+                    std::lock_guard<std::mutex> watermark_lock(owner_.watermark_mutex_);
+
+                    connected_ = true;
+                }
+
+                watermarks_.add(&s);
+            }
+
+            void put_watermark(watermark w, predecessor_type* s) override
+            {
+                if (watermarks_.update(w, s, w))
+                    owner_.advance(*this, w);
+            }
+        private:
+            friend class hash_join_node;
+
+            hash_join_node&             owner_;
+            handler_type                handler_;
+            watermark_tracker<T>        watermarks_;
+            bool                        connected_; // NOTE: Guarded by the owner's watermark_mutex_.
+            watermark                   watermark_; // NOTE: Guarded by the owner's watermark_mutex_.
+        };
+
+        // Forwards the minimum watermark over the connected ports once it advances, evicting what it passed.
+        template<typename T>
+        void advance(port<T>& p, watermark w)
+        {
+            {
+                std::lock_guard<std::mutex> watermark_lock(watermark_mutex_);
+
+                p.watermark_ = w;
+
+                w = std::numeric_limits<watermark>::max();
+                if (left_port_.connected_)
+                    w = std::min(w, left_port_.watermark_);
+                if (right_port_.connected_)
+                    w = std::min(w, right_port_.watermark_);
+                if (left_batch_port_.connected_)
+                    w = std::min(w, left_batch_port_.watermark_);
+
+                if (w <= watermark_)
+                    return;
+
+                watermark_ = w;
+            }
+
+            evict(w);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (queue_.empty())
+                successors_.put_watermark(w);
+            else if (!held_watermark_ || *held_watermark_ < w)
+                held_watermark_ = w;
+        }
+
+        void evict(watermark w)
+        {
+            if (!left_time_ || !right_time_ || w < std::numeric_limits<watermark>::min() + retention_)
+                return;
+
+            left_.evict(w - retention_);
+            right_.evict(w - retention_);
+        }
+
+        void put_left(L& l)
+        {
+            auto key = left_key_(l);
+            auto hash = join_table<Key, L>::hash_of(key);
+
+            std::vector<output_type> matches;
+
+            if (mode_ == join_mode::symmetric)
+            {
+                // NOTE: Both partitions for the key, always left first, so each pair is emitted exactly once.
+                auto& lp = left_.partition_of(hash);
+                auto& rp = right_.partition_of(hash);
+                std::lock_guard<std::mutex> left_lock(lp.mutex);
+                std::lock_guard<std::mutex> right_lock(rp.mutex);
+
+                left_.insert(lp, hash, key, l, false);
+                right_.find(rp, hash, key, [&](const R& r) { matches.emplace_back(l, r); });
+            }
+            else
+            {
+                auto& rp = right_.partition_of(hash);
+                std::lock_guard<std::mutex> right_lock(rp.mutex);
+
+                right_.find(rp, hash, key, [&](const R& r) { matches.emplace_back(l, r); });
+            }
+
+            emit(matches);
+        }
+
+        void put_right(R& r)
+        {
+            auto key = right_key_(r);
+            auto hash = join_table<Key, R>::hash_of(key);
+
+            std::vector<output_type> matches;
+
+            if (mode_ == join_mode::symmetric)
+            {
+                auto& lp = left_.partition_of(hash);
+                auto& rp = right_.partition_of(hash);
+                std::lock_guard<std::mutex> left_lock(lp.mutex);
+                std::lock_guard<std::mutex> right_lock(rp.mutex);
+
+                right_.insert(rp, hash, key, r, false);
+                left_.find(lp, hash, key, [&](const L& l) { matches.emplace_back(l, r); });
+            }
+            else
+            {
+                auto& rp = right_.partition_of(hash);
+                std::lock_guard<std::mutex> right_lock(rp.mutex);
+
+                right_.insert(rp, hash, key, r, true);
+            }
+
+            emit(matches);
+        }
+
+        void put_left_batch(std::vector<L>& batch)
+        {
+            if (mode_ == join_mode::symmetric)
+            {
+                for (auto& l : batch)
+                    put_left(l);
+
+                return;
+            }
+
+            const std::size_t distance = 8;
+
+            std::vector<Key> keys;
+            std::vector<std::uint64_t> hashes;
+            keys.reserve(batch.size());
+            hashes.reserve(batch.size());
+
+            for (auto& l : batch)
+            {
+                keys.push_back(left_key_(l));
+                hashes.push_back(join_table<Key, R>::hash_of(keys.back()));
+            }
+
+            for (std::size_t n = 0; n < distance && n < batch.size(); ++n)
+                right_.prefetch_slot(hashes[n]);
+
+            std::vector<output_type> matches;
+            for (std::size_t n = 0; n < batch.size(); ++n)
+            {
+                if (n + distance < batch.size())
+                    right_.prefetch_slot(hashes[n + distance]);
+
+                auto& rp = right_.partition_of(hashes[n]);
+                std::lock_guard<std::mutex> right_lock(rp.mutex);
+
+                right_.find(rp, hashes[n], keys[n], [&](const R& r) { matches.emplace_back(batch[n], r); });
+            }
+
+            emit(matches);
+        }
+
+        void emit(std::vector<output_type>& matches)
+        {
+            if (matches.empty())
+                return;
+
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            for (auto& o : matches)
+            {
+                if (!queue_.empty() || !successors_.try_put(o))
+                    queue_.push(std::move(o));
+            }
+        }
+
+        const join_mode                 mode_;
+        left_key_type                   left_key_;
+        right_key_type                  right_key_;
+        left_time_type                  left_time_;
+        right_time_type                 right_time_;
+        const watermark                 retention_;
+        join_table<Key, L>              left_;
+        join_table<Key, R>              right_;
+        port<L>                         left_port_;
+        port<R>                         right_port_;
+        port<std::vector<L>>            left_batch_port_;
+        successor_cache<output_type>    successors_;
+        std::queue<output_type>         queue_;
+        boost::optional<watermark>      held_watermark_;
+        std::mutex                      mutex_;
+
+        watermark                       watermark_;
+        std::mutex                      watermark_mutex_;
+    };
+
+    // Tournament tree over k sources that keeps the loser of each match, so replacing the winner's head only
+    // replays its path (log k comparisons). A null head is an exhausted source and never wins.
+    template<typename T, typename Compare = std::less<T>>
+    class loser_tree
+    {
+    public:
+
+        explicit loser_tree(std::size_t k, Compare compare = Compare())
+            : heads_(k, nullptr)
+            , tree_(std::max<std::size_t>(k, 1), 0)
+            , compare_(std::move(compare))
+        {
+        }
+
+        std::size_t size() const
+        {
+            return heads_.size();
+        }
+
+        void set(std::size_t n, const T* head)
+        {
+            heads_[n] = head;
+        }
+
+        void build()
+        {
+            if (!heads_.empty())
+                tree_[0] = build(1);
+        }
+
+        // NOTE: Only valid for the current winner; rebuild after changing any other head.
+        void replay(std::size_t n, const T* head)
+        {
+            heads_[n] = head;
+
+            auto winner = n;
+            for (auto node = (n + heads_.size()) / 2; node > 0; node /= 2)
+            {
+                if (less(tree_[node], winner))
+                    std::swap(tree_[node], winner);
+            }
+
+            tree_[0] = winner;
+        }
+
+        // Returns size() when every source is exhausted.
+        std::size_t winner() const
+        {
+            return heads_.empty() || !heads_[tree_[0]] ? heads_.size() : tree_[0];
+        }
+    private:
+
+        std::size_t build(std::size_t node)
+        {
+            if (node >= heads_.size())
+                return node - heads_.size();
+
+            auto left = build(2 * node);
+            auto right = build(2 * node + 1);
+
+            if (less(right, left))
+            {
+                tree_[node] = left;
+                return right;
+            }
+
+            tree_[node] = right;
+            return left;
+        }
+
+        bool less(std::size_t a, std::size_t b) const
+        {
+            if (!heads_[a])
+                return false;
+
+            if (!heads_[b])
+                return true;
+
+            return compare_(*heads_[a], *heads_[b]);
+        }
+
+        std::vector<const T*>   heads_;
+        std::vector<std::size_t> tree_;     // NOTE: tree_[0] is the winner, tree_[1..k) the losers.
+        Compare                 compare_;
+    };
+
+    // Merges sorted streams into one sorted stream. Every input port buffers up to batch messages and is
+    // refilled by pulling its predecessors a batch at a time. A port ends on an end_of_stream watermark.
+    template<typename T, typename Compare = std::less<T>>
+    class merge_node final
+        : public sender<T>
+    {
+        class port;
+    public:
+
+        merge_node(executor& executor, std::size_t inputs, Compare compare = Compare(), std::size_t batch = 64)
+            : executor_(executor)
+            , successors_(this)
+            , tree_(inputs, std::move(compare))
+            , batch_(std::max<std::size_t>(batch, 1))
+            , starving_(inputs)
+            , dirty_(true)
+            , active_(false)
+            , watermark_(std::numeric_limits<watermark>::min())
+        {
+            for (std::size_t n = 0; n < inputs; ++n)
+                ports_.emplace_back(new port(*this, n));
+        }
+
+        merge_node(const merge_node&) = delete;
+        merge_node(merge_node&&) = delete;
+
+        merge_node& operator=(const merge_node&) = delete;
+        merge_node& operator=(merge_node&&) = delete;
+
+        receiver<T>& input_port(std::size_t n)
+        {
+            return *ports_[n];
+        }
+
+        bool try_get(output_type& o, successor_type* r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (!value_)
+            {
+                successors_.add(r);
+
+                return false;
+            }
+
+            o = std::move(*value_);
+            value_.reset();
+
+            schedule();
+
+            return true;
+        }
+
+        void register_successor(successor_type& r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            successors_.register_successor(&r);
+        }
+
+        std::size_t pending() override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            std::size_t count = value_ ? 1 : 0;
+            for (auto& p : ports_)
+                count += p->buffer_.size();
+
+            return count;
+        }
+    private:
+
+        class port final
+            : public receiver<T>
+        {
+        public:
+
+            port(merge_node& owner, std::size_t index)
+                : owner_(owner)
+                , index_(index)
+                , predecessors_(this)
+                , done_(false)
+                , watermark_(std::numeric_limits<watermark>::min())
+            {
+            }
+
+            bool try_put(input_type& i, predecessor_type* s) override
+            {
+                return owner_.put(*this, i, s);
+            }
+
+            void register_predecessor(predecessor_type& s) override
+            {
+                watermarks_.add(&s);
+            }
+
+            // NOTE: Not under the owner's main lock, since a refill pull may deliver it.
+            void put_watermark(watermark w, predecessor_type* s) override
+            {
+                if (watermarks_.update(w, s, w))
+                    owner_.advance(*this, w);
+            }
+        private:
+            friend class merge_node;
+
+            merge_node&                 owner_;
+            const std::size_t           index_;
+            std::deque<input_type>      buffer_;
+            predecessor_cache<T>        predecessors_;
+            watermark_tracker<T>        watermarks_;
+            bool                        done_;
+            watermark                   watermark_; // NOTE: Guarded by the owner's watermark_mutex_.
+        };
+
+        bool put(port& p, T& i, sender<T>* s)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (p.buffer_.size() >= batch_)
+            {
+                p.predecessors_.add(s);
+
+                return false;
+            }
+
+            p.buffer_.push_back(std::move(i));
+
+            if (p.buffer_.size() == 1)
+            {
+                --starving_;
+                dirty_ = true;
+
+                schedule();
+            }
+
+            return true;
+        }
+
+        void advance(port& p, watermark w)
+        {
+            {
+                std::lock_guard<std::mutex> watermark_lock(watermark_mutex_);
+
+                p.watermark_ = w;
+            }
+
+            executor_.run([this]
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                schedule();
+            });
+        }
+
+        void schedule()
+        {
+            if (active_ || value_)
+                return;
+
+            active_ = true;
+            executor_.run([this]
+            {
+                drain();
+            });
+        }
+
+        bool refill(port& p)
+        {
+            T i;
+            while (p.buffer_.size() < batch_ && p.predecessors_.try_get(i))
+                p.buffer_.push_back(std::move(i));
+
+            return !p.buffer_.empty();
+        }
+
+        void drain()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            while (true)
+            {
+                if (starving_ > 0)
+                {
+                    for (auto& p : ports_)
+                    {
+                        if (!p->buffer_.empty() || p->done_)
+                            continue;
+
+                        if (refill(*p) || ended(*p))
+                        {
+                            p->done_ = p->buffer_.empty();
+                            --starving_;
+                            dirty_ = true;
+                        }
+                    }
+
+                    if (starving_ > 0)
+                        break;
+                }
+
+                if (dirty_)
+                {
+                    for (auto& p : ports_)
+                        tree_.set(p->index_, p->buffer_.empty() ? nullptr : &p->buffer_.front());
+
+                    tree_.build();
+                    dirty_ = false;
+                }
+
+                auto n = tree_.winner();
+                if (n == ports_.size())
+                    break;
+
+                auto& p = *ports_[n];
+
+                auto o = std::move(p.buffer_.front());
+                p.buffer_.pop_front();
+
+                if (!p.buffer_.empty() || refill(p))
+                    tree_.replay(n, &p.buffer_.front());
+                else
+                {
+                    tree_.replay(n, nullptr);
+                    ++starving_;
+                }
+
+                if (!successors_.try_put(o))
+                {
+                    value_ = std::move(o);
+                    break;
+                }
+            }
+
+            active_ = false;
+
+            forward_watermark();
+        }
+
+        bool ended(port& p)
+        {
+            std::lock_guard<std::mutex> watermark_lock(watermark_mutex_);
+
+            return p.watermark_ == end_of_stream;
+        }
+
+        // NOTE: Held back while any message is still buffered, since it may be older.
+        void forward_watermark()
+        {
+            if (value_)
+                return;
+
+            for (auto& p : ports_)
+            {
+                if (!p->buffer_.empty())
+                    return;
+            }
+
+            auto w = std::numeric_limits<watermark>::max();
+            {
+                std::lock_guard<std::mutex> watermark_lock(watermark_mutex_);
+
+                for (auto& p : ports_)
+                    w = std::min(w, p->watermark_);
+            }
+
+            if (w <= watermark_)
+                return;
+
+            watermark_ = w;
+            successors_.put_watermark(w);
+        }
+
+        executor&                           executor_;
+        successor_cache<output_type>        successors_;
+        std::vector<std::unique_ptr<port>>  ports_;
+        loser_tree<T, Compare>              tree_;
+        const std::size_t                   batch_;
+        std::size_t                         starving_;  // NOTE: Live ports with an empty buffer.
+        bool                                dirty_;     // NOTE: A head other than the winner changed.
+        bool                                active_;
+        boost::optional<output_type>        value_;
+        watermark                           watermark_;
+        std::mutex                          mutex_;
+        std::mutex                          watermark_mutex_;
+    };
+
+    // Writes T as raw bytes. Use a custom serializer with the same interface for other types.
+    template<typename T>
+    struct binary_serializer
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "binary_serializer requires a trivially copyable type");
+
+        void write(std::FILE* file, const T& value) const
+        {
+            if (std::fwrite(&value, sizeof(T), 1, file) != 1)
+                throw std::system_error(errno, std::generic_category(), "fwrite");
+        }
+
+        // Returns false at end of file.
+        bool read(std::FILE* file, T& value) const
+        {
+            return std::fread(&value, sizeof(T), 1, file) == 1;
+        }
+    };
+
+    // Sorts a stream within a memory budget (in bytes, estimated from sizeof(T)). Input is cut into runs
+    // that are sorted on the executor and spilled to temporary files; input is rejected while the budget's
+    // runs are all being spilled. flush(), or an end_of_stream watermark, merges the runs and streams the
+    // sorted output. A run that fails to spill is reported by the next flush().
+    template<typename T, typename Compare = std::less<T>, typename Serializer = binary_serializer<T>>
+    class sort_node final
+        : public receiver<T>
+        , public sender<T>
+    {
+    public:
+
+        sort_node(executor& executor, std::size_t budget, Compare compare = Compare(), Serializer serializer = Serializer())
+            : executor_(executor)
+            , compare_(std::move(compare))
+            , serializer_(std::move(serializer))
+            , budget_(std::max<std::size_t>(budget / sizeof(T), 1))
+            , capacity_(std::max<std::size_t>(budget_ / (max_spilling + 1), 1))
+            , successors_(this)
+            , predecessors_(this)
+            , spilling_(0)
+            , merging_(false)
+            , holding_(false)
+        {
+            run_.reserve(capacity_);
+        }
+
+        sort_node(const sort_node&) = delete;
+        sort_node(sort_node&&) = delete;
+
+        sort_node& operator=(const sort_node&) = delete;
+        sort_node& operator=(sort_node&&) = delete;
+
+        // Blocks until every message received so far has been passed on in order. Rethrows the first error
+        // from a spill since the last flush.
+        void flush()
+        {
+            finish();
+        }
+
+        bool try_put(input_type& i, predecessor_type* s) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (merging_ || run_.size() == capacity_)
+            {
+                predecessors_.add(s);
+
+                return false;
+            }
+
+            accept(i);
+
+            return true;
+        }
+
+        bool try_get(output_type& o, successor_type* r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (!value_)
+            {
+                successors_.add(r);
+
+                return false;
+            }
+
+            o = std::move(*value_);
+            value_.reset();
+            cond_.notify_all();
+
+            return true;
+        }
+
+        void register_successor(successor_type& r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            successors_.register_successor(&r);
+        }
+
+        std::size_t pending() override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            return run_.size() + (value_ ? 1 : 0);
+        }
+
+        void register_predecessor(predecessor_type& s) override
+        {
+            watermarks_.add(&s);
+        }
+
+        // NOTE: Held back while any message is held, since sorting may emit older messages after it; passed on
+        //       as soon as everything received has been emitted. end_of_stream also starts the merge, on the
+        //       executor, since this may be called from a pull holding the node's lock.
+        void put_watermark(watermark w, predecessor_type* s) override
+        {
+            if (!watermarks_.update(w, s, w))
+                return;
+
+            {
+                std::lock_guard<std::mutex> watermark_lock(watermark_mutex_);
+
+                if (holding_)
+                    watermark_ = w;
+                else
+                    successors_.put_watermark(w);
+            }
+
+            if (w == end_of_stream)
+            {
+                executor_.run([this]
+                {
+                    finish();
+                });
+            }
+        }
+    private:
+        static const std::size_t max_spilling = 3;
+
+        using file_ptr = std::unique_ptr<std::FILE, int(*)(std::FILE*)>;
+
+        class run_reader
+        {
+        public:
+
+            explicit run_reader(file_ptr file)
+                : file_(std::move(file))
+                , pos_(0)
+            {
+            }
+
+            explicit run_reader(std::vector<T> block)
+                : file_(nullptr, &std::fclose)
+                , block_(std::move(block))
+                , pos_(0)
+            {
+            }
+
+            // Returns null once the run is exhausted.
+            T* head()
+            {
+                return pos_ < block_.size() ? &block_[pos_] : nullptr;
+            }
+
+            void load(const Serializer& serializer, std::size_t block_size)
+            {
+                block_.clear();
+                pos_ = 0;
+
+                T value;
+                while (block_.size() < block_size && serializer.read(file_.get(), value))
+                    block_.push_back(std::move(value));
+            }
+
+            void next(const Serializer& serializer, std::size_t block_size)
+            {
+                if (++pos_ == block_.size() && file_)
+                    load(serializer, block_size);
+            }
+        private:
+            file_ptr        file_;  // NOTE: Null for the in-memory run.
+            std::vector<T>  block_;
+            std::size_t     pos_;
+        };
+
+        // NOTE: Called under mutex_.
+        void spill()
+        {
+            if (spilling_ == max_spilling)
+                return;
+
+            ++spilling_;
+
+            auto run = std::make_shared<std::vector<T>>(std::move(run_));
+            run_.clear();
+            run_.reserve(capacity_);
+
+            executor_.run([this, run]
+            {
+                file_ptr file(nullptr, &std::fclose);
+                std::exception_ptr error;
+
+                try
+                {
+                    std::sort(run->begin(), run->end(), compare_);
+
+                    file.reset(std::tmpfile());
+                    if (!file)
+                        throw std::system_error(errno, std::generic_category(), "tmpfile");
+
+                    for (auto& value : *run)
+                        serializer_.write(file.get(), value);
+
+                    std::rewind(file.get());
+                }
+                catch (...)
+                {
+                    error = std::current_exception();
+                }
+
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                // NOTE: spilling_ must drop on every path, or finish() waits forever.
+                if (!error)
+                    runs_.push_back(std::move(file));
+                else if (!error_)
+                    error_ = error;
+
+                --spilling_;
+                cond_.notify_all();
+
+                if (run_.size() == capacity_)
+                    spill();
+
+                pull();
+            });
+        }
+
+        // NOTE: Called under mutex_.
+        void pull()
+        {
+            T i;
+            while (!merging_ && run_.size() < capacity_ && predecessors_.try_get(i))
+                accept(i);
+        }
+
+        // NOTE: Called under mutex_.
+        void accept(input_type& i)
+        {
+            if (idle())
+                hold(true);
+
+            run_.push_back(std::move(i));
+
+            if (run_.size() == capacity_)
+                spill();
+        }
+
+        // NOTE: Called under mutex_.
+        bool idle() const
+        {
+            return run_.empty() && runs_.empty() && spilling_ == 0 && !merging_ && !value_;
+        }
+
+        // NOTE: Mirrors !idle() under watermark_mutex_.
+        void hold(bool value)
+        {
+            std::lock_guard<std::mutex> watermark_lock(watermark_mutex_);
+
+            holding_ = value;
+
+            if (!holding_ && watermark_)
+            {
+                successors_.put_watermark(*watermark_);
+                watermark_.reset();
+            }
+        }
+
+        void finish()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+
+            if (merging_)
+                return;
+
+            // NOTE: Drain input still held by rejected predecessors.
+            while (true)
+            {
+                pull();
+
+                if (run_.size() < capacity_)
+                    break;
+
+                cond_.wait(lock, [this] { return spilling_ < max_spilling; }); // NOTE: Cooperative block.
+                spill();
+            }
+
+            merging_ = true;
+            cond_.wait(lock, [this] { return spilling_ == 0; }); // NOTE: Cooperative block.
+
+            if (error_)
+            {
+                auto error = error_;
+                error_ = nullptr;
+                merging_ = false;
+
+                std::rethrow_exception(error);
+            }
+
+            auto runs = std::move(runs_);
+            runs_.clear();
+
+            auto last = std::move(run_);
+            run_.clear();
+            run_.reserve(capacity_);
+
+            lock.unlock();
+
+            merge(std::move(runs), std::move(last));
+
+            lock.lock();
+
+            merging_ = false;
+
+            if (idle())
+                hold(false);
+
+            pull();
+        }
+
+        void merge(std::vector<file_ptr> runs, std::vector<T> last)
+        {
+            std::sort(last.begin(), last.end(), compare_);
+
+            // NOTE: The budget is split between one read block per spilled run.
+            auto block_size = std::max<std::size_t>(budget_ / (runs.size() + 1), 1);
+
+            std::vector<run_reader> readers;
+            readers.reserve(runs.size() + 1);
+
+            for (auto& file : runs)
+            {
+                readers.emplace_back(std::move(file));
+                readers.back().load(serializer_, block_size);
+            }
+
+            readers.emplace_back(std::move(last));
+
+            loser_tree<T, Compare> tree(readers.size(), compare_);
+
+            for (std::size_t n = 0; n < readers.size(); ++n)
+                tree.set(n, readers[n].head());
+
+            tree.build();
+
+            for (auto n = tree.winner(); n != readers.size(); n = tree.winner())
+            {
+                auto o = std::move(*readers[n].head());
+
+                readers[n].next(serializer_, block_size);
+                tree.replay(n, readers[n].head());
+
+                emit(o);
+            }
+        }
+
+        void emit(output_type& o)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+
+            if (!successors_.try_put(o))
+                value_ = std::move(o);
+
+            while (value_)
+                cond_.wait(lock); // NOTE: Cooperative block.
+        }
+
+        executor&                       executor_;
+        Compare                         compare_;
+        Serializer                      serializer_;
+        const std::size_t               budget_;    // NOTE: In messages.
+        const std::size_t               capacity_;  // NOTE: Messages per run.
+        successor_cache<output_type>    successors_;
+        predecessor_cache<input_type>   predecessors_;
+        watermark_tracker<T>            watermarks_;
+        std::vector<T>                  run_;
+        std::vector<file_ptr>           runs_;
+        std::size_t                     spilling_;
+        bool                            merging_;
+        std::exception_ptr              error_;
+        boost::optional<output_type>    value_;
+        std::condition_variable         cond_;
+        std::mutex                      mutex_;
+
+        bool                            holding_;
+        boost::optional<watermark>      watermark_;
+        std::mutex                      watermark_mutex_;
+    };
+
+    // Shared lower bound for topk_node; only kept when T fits in a std::atomic.
+    template<typename T, typename Compare, bool = std::is_trivially_copyable<T>::value>
+    class topk_threshold
+    {
+    public:
+
+        bool rejects(const T& value, Compare& compare) const
+        {
+            return false;
+        }
+
+        void raise(const T& value, Compare& compare)
+        {
+        }
+
+        void reset()
+        {
+        }
+    };
+
+    template<typename T, typename Compare>
+    class topk_threshold<T, Compare, true>
+    {
+    public:
+
+        topk_threshold()
+            : set_(false)
+        {
+        }
+
+        // NOTE: Lock free when std::atomic<T>::is_always_lock_free; wider types go through the atomic's own
+        //       lock. Reading a stale value only rejects less.
+        bool rejects(const T& value, Compare& compare) const
+        {
+            return set_.load(std::memory_order_acquire) && !compare(value_.load(std::memory_order_relaxed), value);
+        }
+
+        void raise(const T& value, Compare& compare)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (set_.load(std::memory_order_relaxed) && !compare(value_.load(std::memory_order_relaxed), value))
+                return;
+
+            value_.store(value, std::memory_order_relaxed);
+            set_.store(true, std::memory_order_release);
+        }
+
+        void reset()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            set_.store(false, std::memory_order_release);
+        }
+    private:
+        std::atomic<bool>   set_;
+        std::atomic<T>      value_;
+        std::mutex          mutex_;
+    };
+
+    // Keeps the k greatest messages according to Compare in bounded per-worker heaps and merges them when
+    // flushed, like aggregate_node. Each flush emits them best first and starts over. Every full heap's worst
+    // message is a lower bound for the result, so the best of those bounds is shared and anything not above it
+    // is dropped without taking the node's locks.
+    template<typename T, typename Compare = std::less<T>>
+    class topk_node final
+        : public receiver<T>
+        , public sender<std::vector<T>>
+    {
+    public:
+
+        explicit topk_node(std::size_t k, Compare compare = Compare())
+            : k_(std::max<std::size_t>(k, 1))
+            , compare_(std::move(compare))
+            , heaps_([k] { std::vector<T> heap; heap.reserve(k); return heap; })
+            , successors_(this)
+            , flush_(*this)
+        {
+        }
+
+        topk_node(const topk_node&) = delete;
+        topk_node(topk_node&&) = delete;
+
+        topk_node& operator=(const topk_node&) = delete;
+        topk_node& operator=(topk_node&&) = delete;
+
+        receiver<continue_msg>& flush_port()
+        {
+            return flush_;
+        }
+
+        // NOTE: Messages racing with a flush may still be dropped against the previous threshold.
+        void flush()
+        {
+            std::vector<T> result;
+
+            heaps_.combine_each([&](std::vector<T>& heap)
+            {
+                result.insert(result.end(), heap.begin(), heap.end());
+                heap.clear();
+            });
+
+            threshold_.reset();
+
+            auto better = [this](const T& a, const T& b) { return compare_(b, a); };
+
+            if (result.size() > k_)
+            {
+                std::nth_element(result.begin(), result.begin() + k_, result.end(), better);
+                result.erase(result.begin() + k_, result.end());
+            }
+
+            std::sort(result.begin(), result.end(), better);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (!queue_.empty() || !successors_.try_put(result))
+                queue_.push(std::move(result));
+        }
+
+        bool try_put(input_type& i, predecessor_type* s) override
+        {
+            if (threshold_.rejects(i, compare_))
+                return true;
+
+            heaps_.local([&](std::vector<T>& heap)
+            {
+                auto worse = [this](const T& a, const T& b) { return compare_(b, a); };
+
+                if (heap.size() < k_)
+                {
+                    heap.push_back(i);
+                    std::push_heap(heap.begin(), heap.end(), worse);
+                }
+                else if (compare_(heap.front(), i))
+                {
+                    std::pop_heap(heap.begin(), heap.end(), worse);
+                    heap.back() = i;
+                    std::push_heap(heap.begin(), heap.end(), worse);
+                }
+                else
+                    return;
+
+                if (heap.size() == k_)
+                    threshold_.raise(heap.front(), compare_);
+            });
+
+            return true;
+        }
+
+        bool try_get(output_type& o, successor_type* r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (queue_.empty())
+            {
+                successors_.add(r);
+
+                return false;
+            }
+
+            o = std::move(queue_.front());
+            queue_.pop();
+
+            return true;
+        }
+
+        void register_successor(successor_type& r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            successors_.register_successor(&r);
+        }
+
+        std::size_t pending() override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            return queue_.size();
+        }
+
+        void register_predecessor(predecessor_type& s) override
+        {
+            watermarks_.add(&s);
+        }
+
+        // NOTE: end_of_stream flushes the heaps before it is passed on.
+        void put_watermark(watermark w, predecessor_type* s) override
+        {
+            if (!watermarks_.update(w, s, w))
+                return;
+
+            if (w == end_of_stream)
+                flush();
+
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            successors_.put_watermark(w);
+        }
+    private:
+
+        class flush_port_type final
+            : public receiver<continue_msg>
+        {
+        public:
+
+            flush_port_type(topk_node& owner)
+                : owner_(owner)
+            {
+            }
+
+            bool try_put(input_type& i, predecessor_type* s) override
+            {
+                owner_.flush();
+
+                return true;
+            }
+        private:
+            topk_node& owner_;
+        };
+
+        const std::size_t               k_;
+        Compare                         compare_;
+        worker_local<std::vector<T>>    heaps_;
+        topk_threshold<T, Compare>      threshold_;
+        successor_cache<output_type>    successors_;
+        std::queue<output_type>         queue_;
+        flush_port_type                 flush_;
+        watermark_tracker<T>            watermarks_;
+        std::mutex                      mutex_;
+    };
+
+    // Mergeable quantile sketch with relative accuracy alpha (DDSketch). Values are counted in logarithmic
+    // buckets; past max_bins the lowest buckets are collapsed, which keeps memory constant at the cost of
+    // accuracy for the smallest values. Zero and negative values are counted as zero.
+    class ddsketch
+    {
+    public:
+
+        explicit ddsketch(double alpha = 0.01, std::size_t max_bins = 2048)
+            : gamma_((1 + alpha) / (1 - alpha))
+            , inv_log_gamma_(1 / std::log(gamma_))
+            , max_bins_(std::max<std::size_t>(max_bins, 1))
+            , offset_(0)
+            , zero_(0)
+            , count_(0)
+        {
+            ASSERT(alpha > 0 && alpha < 1);
+        }
+
+        void add(double value, std::uint64_t n = 1)
+        {
+            count_ += n;
+
+            if (!(value > 0))
+                zero_ += n;
+            else
+                bins_[index(static_cast<int>(std::ceil(std::log(value) * inv_log_gamma_)))] += n;
+        }
+
+        void merge(const ddsketch& other)
+        {
+            ASSERT(gamma_ == other.gamma_);
+
+            count_ += other.count_;
+            zero_ += other.zero_;
+
+            for (std::size_t n = 0; n < other.bins_.size(); ++n)
+            {
+                if (other.bins_[n] > 0)
+                    bins_[index(other.offset_ + static_cast<int>(n))] += other.bins_[n];
+            }
+        }
+
+        // Returns NaN while empty.
+        double quantile(double q) const
+        {
+            if (count_ == 0)
+                return std::numeric_limits<double>::quiet_NaN();
+
+            auto rank = static_cast<std::uint64_t>(q * (count_ - 1));
+            if (rank < zero_)
+                return 0;
+
+            auto seen = zero_;
+            for (std::size_t n = 0; n < bins_.size(); ++n)
+            {
+                seen += bins_[n];
+
+                if (seen > rank)
+                    return 2 * std::pow(gamma_, offset_ + static_cast<int>(n)) / (gamma_ + 1);
+            }
+
+            return 2 * std::pow(gamma_, offset_ + static_cast<int>(bins_.size()) - 1) / (gamma_ + 1);
+        }
+
+        std::uint64_t count() const
+        {
+            return count_;
+        }
+
+        void clear()
+        {
+            bins_.clear();
+            offset_ = 0;
+            zero_ = 0;
+            count_ = 0;
+        }
+    private:
+
+        std::size_t index(int key)
+        {
+            if (bins_.empty())
+            {
+                bins_.assign(1, 0);
+                offset_ = key;
+            }
+            else if (key < offset_)
+            {
+                auto top = offset_ + static_cast<int>(bins_.size()) - 1;
+                auto bottom = std::max(key, top - static_cast<int>(max_bins_) + 1);
+
+                bins_.insert(bins_.begin(), offset_ - bottom, 0);
+                offset_ = bottom;
+
+                return 0; // NOTE: Below bottom is collapsed into the lowest bucket.
+            }
+            else if (key - offset_ >= static_cast<int>(bins_.size()))
+            {
+                if (key - offset_ >= static_cast<int>(max_bins_))
+                    collapse(key - static_cast<int>(max_bins_) + 1);
+
+                bins_.resize(key - offset_ + 1, 0);
+            }
+
+            return key - offset_;
+        }
+
+        // Folds every bucket below bottom into bottom.
+        void collapse(int bottom)
+        {
+            auto folded = std::min<std::size_t>(bottom - offset_, bins_.size());
+
+            std::uint64_t count = 0;
+            for (std::size_t n = 0; n < folded; ++n)
+                count += bins_[n];
+
+            bins_.erase(bins_.begin(), bins_.begin() + folded);
+
+            if (bins_.empty())
+                bins_.assign(1, 0);
+
+            bins_[0] += count;
+            offset_ = bottom;
+        }
+
+        double                      gamma_;
+        double                      inv_log_gamma_;
+        std::size_t                 max_bins_;
+        std::vector<std::uint64_t>  bins_;
+        int                         offset_;    // NOTE: Key of bins_[0].
+        std::uint64_t               zero_;
+        std::uint64_t               count_;
+    };
+
+    struct quantile_snapshot
+    {
+        std::uint64_t   count;
+        double          p50;
+        double          p99;
+        double          p999;
+    };
+
+    // Tracks the distribution of its input in per-worker sketches. quantile() merges them on demand, while a
+    // flush emits a quantile_snapshot of everything since the previous flush and starts over.
+    class quantile_node final
+        : public receiver<double>
+        , public sender<quantile_snapshot>
+    {
+    public:
+
+        explicit quantile_node(double alpha = 0.01, std::size_t max_bins = 2048)
+            : alpha_(alpha)
+            , max_bins_(max_bins)
+            , sketches_([alpha, max_bins] { return ddsketch(alpha, max_bins); })
+            , successors_(this)
+            , flush_(*this)
+        {
+        }
+
+        quantile_node(const quantile_node&) = delete;
+        quantile_node(quantile_node&&) = delete;
+
+        quantile_node& operator=(const quantile_node&) = delete;
+        quantile_node& operator=(quantile_node&&) = delete;
+
+        receiver<continue_msg>& flush_port()
+        {
+            return flush_;
+        }
+
+        // Flushes on processing time.
+        void fire_every(executor& executor, std::chrono::milliseconds period)
+        {
+            timer_.reset(new periodic_timer(executor, period, [this]
+            {
+                flush();
+            }));
+        }
+
+        // Returns NaN while empty.
+        double quantile(double q)
+        {
+            ddsketch merged(alpha_, max_bins_);
+
+            sketches_.combine_each([&](ddsketch& sketch)
+            {
+                merged.merge(sketch);
+            });
+
+            return merged.quantile(q);
+        }
+
+        void flush()
+        {
+            ddsketch merged(alpha_, max_bins_);
+
+            sketches_.combine_each([&](ddsketch& sketch)
+            {
+                merged.merge(sketch);
+                sketch.clear();
+            });
+
+            quantile_snapshot snapshot = { merged.count(), merged.quantile(0.5), merged.quantile(0.99), merged.quantile(0.999) };
+
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (!queue_.empty() || !successors_.try_put(snapshot))
+                queue_.push(snapshot);
+        }
+
+        bool try_put(input_type& i, predecessor_type* s) override
+        {
+            sketches_.local([&](ddsketch& sketch)
+            {
+                sketch.add(i);
+            });
+
+            return true;
+        }
+
+        bool try_get(output_type& o, successor_type* r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (queue_.empty())
+            {
+                successors_.add(r);
+
+                return false;
+            }
+
+            o = queue_.front();
+            queue_.pop();
+
+            return true;
+        }
+
+        void register_successor(successor_type& r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            successors_.register_successor(&r);
+        }
+
+        std::size_t pending() override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            return queue_.size();
+        }
+
+        void register_predecessor(predecessor_type& s) override
+        {
+            watermarks_.add(&s);
+        }
+
+        // NOTE: end_of_stream flushes the sketches before it is passed on.
+        void put_watermark(watermark w, predecessor_type* s) override
+        {
+            if (!watermarks_.update(w, s, w))
+                return;
+
+            if (w == end_of_stream)
+                flush();
+
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            successors_.put_watermark(w);
+        }
+    private:
+
+        class flush_port_type final
+            : public receiver<continue_msg>
+        {
+        public:
+
+            flush_port_type(quantile_node& owner)
+                : owner_(owner)
+            {
+            }
+
+            bool try_put(input_type& i, predecessor_type* s) override
+            {
+                owner_.flush();
+
+                return true;
+            }
+        private:
+            quantile_node& owner_;
+        };
+
+        const double                    alpha_;
+        const std::size_t               max_bins_;
+        worker_local<ddsketch>          sketches_;
+        successor_cache<output_type>    successors_;
+        std::queue<output_type>         queue_;
+        flush_port_type                 flush_;
+        watermark_tracker<double>       watermarks_;
+        std::mutex                      mutex_;
+        std::unique_ptr<periodic_timer> timer_; // NOTE: Declared last so it stops before the state it fires on is destroyed.
+    };
+
+    inline unsigned leading_zeros(std::uint64_t x)
+    {
+#if defined(_MSC_VER)
+        unsigned long index;
+        return _BitScanReverse64(&index, x) ? 63 - index : 64;
+#else
+        return x ? __builtin_clzll(x) : 64;
+#endif
+    }
+
+    // out[n] = max(out[n], in[n]).
+    inline void max_into(std::uint8_t* out, const std::uint8_t* in, std::size_t size)
+    {
+        std::size_t n = 0;
+
+#if defined(__AVX2__)
+        for (; n + 32 <= size; n += 32)
+        {
+            auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(out + n));
+            auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + n));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + n), _mm256_max_epu8(a, b));
+        }
+#elif defined(__SSE2__) || defined(_M_X64)
+        for (; n + 16 <= size; n += 16)
+        {
+            auto a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(out + n));
+            auto b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + n));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + n), _mm_max_epu8(a, b));
+        }
+#endif
+
+        for (; n < size; ++n)
+            out[n] = std::max(out[n], in[n]);
+    }
+
+    // out[n] += in[n], wrapping on overflow.
+    inline void add_into(std::uint32_t* out, const std::uint32_t* in, std::size_t size)
+    {
+        std::size_t n = 0;
+
+#if defined(__AVX2__)
+        for (; n + 8 <= size; n += 8)
+        {
+            auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(out + n));
+            auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + n));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + n), _mm256_add_epi32(a, b));
+        }
+#elif defined(__SSE2__) || defined(_M_X64)
+        for (; n + 4 <= size; n += 4)
+        {
+            auto a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(out + n));
+            auto b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + n));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + n), _mm_add_epi32(a, b));
+        }
+#endif
+
+        for (; n < size; ++n)
+            out[n] += in[n];
+    }
+
+    // HyperLogLog distinct counter with 2^precision one byte registers (standard error 1.04 / sqrt(2^precision)).
+    class hll_sketch
+    {
+    public:
+
+        explicit hll_sketch(unsigned precision = 14)
+            : precision_(precision)
+            , registers_(std::size_t(1) << precision, 0)
+        {
+            ASSERT(precision >= 4 && precision <= 18);
+        }
+
+        // NOTE: hash must be well mixed, see mix_hash.
+        void add(std::uint64_t hash)
+        {
+            auto& r = registers_[hash >> (64 - precision_)];
+            auto rank = static_cast<std::uint8_t>(std::min(leading_zeros(hash << precision_), 64 - precision_) + 1);
+
+            r = std::max(r, rank);
+        }
+
+        void merge(const hll_sketch& other)
+        {
+            ASSERT(precision_ == other.precision_);
+
+            max_into(registers_.data(), other.registers_.data(), registers_.size());
+        }
+
+        double estimate() const
+        {
+            const double m = static_cast<double>(registers_.size());
+
+            double sum = 0;
+            std::size_t zeros = 0;
+            for (auto r : registers_)
+            {
+                sum += std::ldexp(1.0, -r);
+                zeros += r == 0;
+            }
+
+            double alpha = m == 16 ? 0.673 : m == 32 ? 0.697 : m == 64 ? 0.709 : 0.7213 / (1 + 1.079 / m);
+            double e = alpha * m * m / sum;
+
+            // NOTE: Linear counting is more accurate for small cardinalities.
+            if (e <= 2.5 * m && zeros > 0)
+                return m * std::log(m / zeros);
+
+            return e;
+        }
+
+        void clear()
+        {
+            std::fill(registers_.begin(), registers_.end(), 0);
+        }
+    private:
+        unsigned                                                precision_;
+        std::vector<std::uint8_t, aligned_allocator<std::uint8_t>>  registers_;
+    };
+
+    // Count-min sketch with depth rows of width 32 bit counters. Estimates never undercount and overcount by
+    // at most e / width of the total with probability 1 - exp(-depth).
+    class count_min_sketch
+    {
+    public:
+
+        explicit count_min_sketch(std::size_t width = 2048, std::size_t depth = 4)
+            : width_(width)
+            , depth_(depth)
+            , counters_(width * depth, 0)
+        {
+            ASSERT(width > 0 && (width & (width - 1)) == 0 && depth > 0);
+        }
+
+        // Returns the new estimate for hash. NOTE: hash must be well mixed, see mix_hash.
+        std::uint32_t add(std::uint64_t hash, std::uint32_t n = 1)
+        {
+            auto result = std::numeric_limits<std::uint32_t>::max();
+
+            for (std::size_t row = 0; row < depth_; ++row)
+            {
+                auto& counter = counters_[row * width_ + slot(hash, row)];
+                counter += n;
+                result = std::min(result, counter);
+            }
+
+            return result;
+        }
+
+        std::uint32_t estimate(std::uint64_t hash) const
+        {
+            auto result = std::numeric_limits<std::uint32_t>::max();
+
+            for (std::size_t row = 0; row < depth_; ++row)
+                result = std::min(result, counters_[row * width_ + slot(hash, row)]);
+
+            return result;
+        }
+
+        void merge(const count_min_sketch& other)
+        {
+            ASSERT(width_ == other.width_ && depth_ == other.depth_);
+
+            add_into(counters_.data(), other.counters_.data(), counters_.size());
+        }
+
+        void clear()
+        {
+            std::fill(counters_.begin(), counters_.end(), 0);
+        }
+    private:
+
+        // NOTE: Double hashing derives every row's slot from one 64 bit hash.
+        std::size_t slot(std::uint64_t hash, std::size_t row) const
+        {
+            auto h1 = static_cast<std::uint32_t>(hash);
+            auto h2 = static_cast<std::uint32_t>(hash >> 32) | 1;
+
+            return (h1 + row * h2) & (width_ - 1);
+        }
+
+        std::size_t                                                 width_;
+        std::size_t                                                 depth_;
+        std::vector<std::uint32_t, aligned_allocator<std::uint32_t>> counters_;
+    };
+
+    // Counts distinct messages in per-worker HyperLogLog sketches. A flush emits the estimate of distinct
+    // messages since the previous flush and starts over.
+    template<typename T, typename Hash = std::hash<T>>
+    class hll_node final
+        : public receiver<T>
+        , public sender<double>
+    {
+    public:
+
+        explicit hll_node(unsigned precision = 14, Hash hash = Hash())
+            : precision_(precision)
+            , hash_(std::move(hash))
+            , sketches_([precision] { return hll_sketch(precision); })
+            , successors_(this)
+            , flush_(*this)
+        {
+        }
+
+        hll_node(const hll_node&) = delete;
+        hll_node(hll_node&&) = delete;
+
+        hll_node& operator=(const hll_node&) = delete;
+        hll_node& operator=(hll_node&&) = delete;
+
+        receiver<continue_msg>& flush_port()
+        {
+            return flush_;
+        }
+
+        // Flushes on processing time.
+        void fire_every(executor& executor, std::chrono::milliseconds period)
+        {
+            timer_.reset(new periodic_timer(executor, period, [this]
+            {
+                flush();
+            }));
+        }
+
+        double estimate()
+        {
+            hll_sketch merged(precision_);
+
+            sketches_.combine_each([&](hll_sketch& sketch)
+            {
+                merged.merge(sketch);
+            });
+
+            return merged.estimate();
+        }
+
+        void flush()
+        {
+            hll_sketch merged(precision_);
+
+            sketches_.combine_each([&](hll_sketch& sketch)
+            {
+                merged.merge(sketch);
+                sketch.clear();
+            });
+
+            auto result = merged.estimate();
+
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (!queue_.empty() || !successors_.try_put(result))
+                queue_.push(result);
+        }
+
+        bool try_put(input_type& i, predecessor_type* s) override
+        {
+            auto hash = mix_hash(hash_(i));
+
+            sketches_.local([&](hll_sketch& sketch)
+            {
+                sketch.add(hash);
+            });
+
+            return true;
+        }
+
+        bool try_get(output_type& o, successor_type* r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (queue_.empty())
+            {
+                successors_.add(r);
+
+                return false;
+            }
+
+            o = queue_.front();
+            queue_.pop();
+
+            return true;
+        }
+
+        void register_successor(successor_type& r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            successors_.register_successor(&r);
+        }
+
+        std::size_t pending() override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            return queue_.size();
+        }
+
+        void register_predecessor(predecessor_type& s) override
+        {
+            watermarks_.add(&s);
+        }
+
+        // NOTE: end_of_stream flushes the sketches before it is passed on.
+        void put_watermark(watermark w, predecessor_type* s) override
+        {
+            if (!watermarks_.update(w, s, w))
+                return;
+
+            if (w == end_of_stream)
+                flush();
+
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            successors_.put_watermark(w);
+        }
+    private:
+
+        class flush_port_type final
+            : public receiver<continue_msg>
+        {
+        public:
+
+            flush_port_type(hll_node& owner)
+                : owner_(owner)
+            {
+            }
+
+            bool try_put(input_type& i, predecessor_type* s) override
+            {
+                owner_.flush();
+
+                return true;
+            }
+        private:
+            hll_node& owner_;
+        };
+
+        const unsigned                  precision_;
+        Hash                            hash_;
+        worker_local<hll_sketch>        sketches_;
+        successor_cache<output_type>    successors_;
+        std::queue<output_type>         queue_;
+        flush_port_type                 flush_;
+        watermark_tracker<T>            watermarks_;
+        std::mutex                      mutex_;
+        std::unique_ptr<periodic_timer> timer_; // NOTE: Declared last so it stops before the state it fires on is destroyed.
+    };
+
+    // Finds frequent messages with per-worker count-min sketches. Each worker also keeps at most capacity
+    // candidates with the highest estimates it has seen. A flush re-estimates every candidate against the
+    // merged sketch, emits the capacity most frequent, highest count first, and starts over.
+    template<typename T, typename Hash = std::hash<T>>
+    class count_min_node final
+        : public receiver<T>
+        , public sender<std::vector<std::pair<T, std::uint64_t>>>
+    {
+        struct partial
+        {
+            partial(std::size_t width, std::size_t depth)
+                : sketch(width, depth)
+            {
+            }
+
+            // Drops the lowest candidate if count beats it. A hit only updates candidates, so an index entry
+            // can lag behind; stale entries that reach the front are re-indexed before being compared.
+            bool evict(std::uint32_t count)
+            {
+                while (true)
+                {
+                    auto lowest = index.begin();
+                    if (count <= lowest->first)
+                        return false;
+
+                    auto c = candidates.find(*lowest->second);
+                    if (c->second > lowest->first)
+                    {
+                        auto node = index.extract(lowest);
+                        node.key() = c->second;
+                        index.insert(std::move(node));
+                        continue;
+                    }
+
+                    index.erase(lowest);
+                    candidates.erase(c);
+
+                    return true;
+                }
+            }
+
+            count_min_sketch                                sketch;
+            std::unordered_map<T, std::uint32_t, Hash>      candidates;
+            std::multimap<std::uint32_t, const T*>          index;  // NOTE: Estimate when last indexed, at most the current one.
+        };
+    public:
+
+        explicit count_min_node(std::size_t capacity = 100, std::size_t width = 2048, std::size_t depth = 4, Hash hash = Hash())
+            : capacity_(std::max<std::size_t>(capacity, 1))
+            , width_(width)
+            , depth_(depth)
+            , hash_(hash)
+            , partials_([=] { return partial(width, depth); })
+            , successors_(this)
+            , flush_(*this)
+        {
+        }
+
+        count_min_node(const count_min_node&) = delete;
+        count_min_node(count_min_node&&) = delete;
+
+        count_min_node& operator=(const count_min_node&) = delete;
+        count_min_node& operator=(count_min_node&&) = delete;
+
+        receiver<continue_msg>& flush_port()
+        {
+            return flush_;
+        }
+
+        // Flushes on processing time.
+        void fire_every(executor& executor, std::chrono::milliseconds period)
+        {
+            timer_.reset(new periodic_timer(executor, period, [this]
+            {
+                flush();
+            }));
+        }
+
+        void flush()
+        {
+            count_min_sketch merged(width_, depth_);
+            std::unordered_set<T, Hash> candidates(0, hash_); // NOTE: T need only be hashable, not ordered.
+
+            partials_.combine_each([&](partial& p)
+            {
+                merged.merge(p.sketch);
+
+                for (auto& c : p.candidates)
+                    candidates.insert(c.first);
+
+                p.sketch.clear();
+                p.index.clear();
+                p.candidates.clear();
+            });
+
+            output_type result;
+            result.reserve(candidates.size());
+
+            for (auto& c : candidates)
+                result.emplace_back(c, merged.estimate(mix_hash(hash_(c))));
+
+            auto higher = [](const std::pair<T, std::uint64_t>& a, const std::pair<T, std::uint64_t>& b) { return a.second > b.second; };
+
+            if (result.size() > capacity_)
+            {
+                std::nth_element(result.begin(), result.begin() + capacity_, result.end(), higher);
+                result.erase(result.begin() + capacity_, result.end());
+            }
+
+            std::sort(result.begin(), result.end(), higher);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (!queue_.empty() || !successors_.try_put(result))
+                queue_.push(std::move(result));
+        }
+
+        bool try_put(input_type& i, predecessor_type* s) override
+        {
+            auto hash = mix_hash(hash_(i));
+
+            partials_.local([&](partial& p)
+            {
+                auto count = p.sketch.add(hash);
+
+                auto it = p.candidates.find(i);
+                if (it != p.candidates.end())
+                {
+                    it->second = count;
+                    return;
+                }
+
+                if (p.candidates.size() == capacity_ && !p.evict(count))
+                    return;
+
+                auto c = p.candidates.emplace(i, count).first;
+                p.index.emplace(count, &c->first);
+            });
+
+            return true;
+        }
+
+        bool try_get(output_type& o, successor_type* r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (queue_.empty())
+            {
+                successors_.add(r);
+
+                return false;
+            }
+
+            o = std::move(queue_.front());
+            queue_.pop();
+
+            return true;
+        }
+
+        void register_successor(successor_type& r) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            successors_.register_successor(&r);
+        }
+
+        std::size_t pending() override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            return queue_.size();
+        }
+
+        void register_predecessor(predecessor_type& s) override
+        {
+            watermarks_.add(&s);
+        }
+
+        // NOTE: end_of_stream flushes the sketches before it is passed on.
+        void put_watermark(watermark w, predecessor_type* s) override
+        {
+            if (!watermarks_.update(w, s, w))
+                return;
+
+            if (w == end_of_stream)
+                flush();
+
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            successors_.put_watermark(w);
+        }
+    private:
+
+        class flush_port_type final
+            : public receiver<continue_msg>
+        {
+        public:
+
+            flush_port_type(count_min_node& owner)
+                : owner_(owner)
+            {
+            }
+
+            bool try_put(input_type& i, predecessor_type* s) override
+            {
+                owner_.flush();
+
+                return true;
+            }
+        private:
+            count_min_node& owner_;
+        };
+
+        const std::size_t               capacity_;
+        const std::size_t               width_;
+        const std::size_t               depth_;
+        Hash                            hash_;
+        worker_local<partial>           partials_;
+        successor_cache<output_type>    successors_;
+        std::queue<output_type>         queue_;
+        flush_port_type                 flush_;
+        watermark_tracker<T>            watermarks_;
+        std::mutex                      mutex_;
+        std::unique_ptr<periodic_timer> timer_; // NOTE: Declared last so it stops before the state it fires on is destroyed.
+    };
+
+    enum class sample_mode
+    {
+        bernoulli,
+        reservoir,
+        every_nth
+    };
+
+    struct sample_spec
+    {
+        static sample_spec bernoulli(double rate)
+        {
+            return sample_spec{ sample_mode::bernoulli, rate, 0 }.validate();
+        }
+
+        static sample_spec reservoir(std::size_t size)
+        {
+            return sample_spec{ sample_mode::reservoir, 0, size }.validate();
+        }
+
+        static sample_spec every_nth(std::size_t n)
+        {
+            return sample_spec{ sample_mode::every_nth, 0, n }.validate();
+        }
+
+        // Throws std::invalid_argument unless rate is in (0, 1] for bernoulli, or size is non-zero otherwise.
+        const sample_spec& validate() const
+        {
+            if (mode == sample_mode::bernoulli && !(rate > 0 && rate <= 1))
+                throw std::invalid_argument("sample_spec: rate must be in (0, 1]");
+
+            if (mode != sample_mode::bernoulli && size == 0)
+                throw std::invalid_argument("sample_spec: size must be non-zero");
+
+            return *this;
+        }
+
+        sample_mode     mode;
+        double          rate;
+        std::size_t     size;   // NOTE: Reservoir size, or N.
+    };
+
+    // Passes on a sample of its input. Bernoulli passes every message with probability rate and 1-in-N every
+    // Nth message per worker, both as they arrive. Reservoir keeps a uniform sample of size messages per
+    // worker (Algorithm L) and a flush emits a uniform sample of everything since the previous flush.
+    // Each worker counts down the messages to skip before its next sample, so skipped messages cost a
+    // decrement and a branch and are never copied. A sample is rejected while an earlier one is still queued;
+    // it isn't counted then, and is drawn again from the messages this node pulls once the queue drains.
+    template<typename T>
+    class sample_node final
+        : public receiver<T>
+        , public sender<T>
+    {
+        struct worker
+            : cache_aligned
+        {
+            worker()
+                : skip(0)
+                , rng(std::random_device()())
+                , seen(0)
+                , armed(0)
+                , w(0)
+            {
+            }
+
+            std::atomic<std::int64_t>   skip;
+            std::mt19937_64             rng;
+            std::mutex                  mutex;      // NOTE: Guards the rest against flush.
+            std::vector<T>              reservoir;
+            std::uint64_t               seen;       // NOTE: Messages up to the last sample.
+            std::int64_t                armed;      // NOTE: Skip set at the last sample.
+            double                      w;
+        };
+    public:
+
+        explicit sample_node(sample_spec spec)
+            : spec_(spec.validate())
+            , successors_(this)
+            , predecessors_(this)
+            , workers_([this] { return create(); })
+            , flush_(*this)
+            , ending_(false)
+        {
+        }
+
+        sample_node(const sample_node&) = delete;
+        sample_node(sample_node&&) = delete;
+
+        sample_node& operator=(const sample_node&) = delete;
+        sample_node& operator=(sample_node&&) = delete;
+
+        receiver<continue_msg>& flush_port()
+        {
+            return flush_;
+        }
+
+        // Emits the reservoir sample, merged over workers in proportion to the messages each has seen.
+        void flush()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                emit_sample();
+            }
+
+            release_end();
+        }
+
+        bool try_put(input_type& i, predecessor_type* s) override
+        {
+            auto& w = *workers_.local();
+
+            if (w.skip.fetch_sub(1, std::memory_order_relaxed) > 0)
+                return true;
+
+            if (spec_.mode == sample_mode::reservoir)
+            {
+                keep(w, i);
+
+                return true;
+            }
+
+            auto accepted = false;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                if (queue_.empty())
+                {
+                    w.skip.store(next_skip(w), std::memory_order_relaxed);
+
+                    if (!successors_.try_put(i))
+                        queue_.push(std::move(i));
+
+                    accepted = true;
+                }
+                else
+                {
+                    // NOTE: Uncounted, so the sample is drawn again among the messages pulled later.
+                    w.skip.fetch_add(1, std::memory_order_relaxed);
+
+                    predecessors_.add(s);
+                }
+            }
+
+            release_end();
+
+            return accepted;
+        }
+
+        bool try_get(output_type& o, successor_type* r) override
+        {
+            auto& w = *workers_.local();
+
+            auto result = false;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                if (!queue_.empty())
+                {
+                    o = std::move(queue_.front());
+                    queue_.pop();
+
+                    result = true;
+                }
+                else
+                {
+                    input_type i;
+                    while (!result && predecessors_.try_get(i))
+                    {
+                        if (w.skip.fetch_sub(1, std::memory_order_relaxed) > 0)
+                            continue;
+
+                        w.skip.store(next_skip(w), std::memory_order_relaxed);
+
+                        o = std::move(i);
+                        result = true;
+                    }
+
+                    if (!result)
+                        successors_.add(r);
+                }
+            }
+
+            release_end();
+
+            return result;
+        }
+
+        void register_successor(successor_type& r) override
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                successors_.register_successor(&r);
+            }
+
+            release_end();
+        }
+
+        std::size_t pending() override
+        {
+            std::size_t count = 0;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                count = queue_.size();
+            }
+
+            release_end();
+
+            return count;
+        }
+
+        void register_predecessor(predecessor_type& s) override
+        {
+            watermarks_.add(&s);
+        }
+
+        // NOTE: Other watermarks are passed on without the node lock, so a consumer pulling through this node
+        // may be delivering them. end_of_stream first flushes the reservoirs under the lock; since it may
+        // arrive while this node pulls under that lock, it is parked and released by whoever holds the lock
+        // next, and every section under mutex_ calls release_end() after unlocking.
+        void put_watermark(watermark w, predecessor_type* s) override
+        {
+            if (!watermarks_.update(w, s, w))
+                return;
+
+            if (w != end_of_stream)
+            {
+                successors_.put_watermark(w);
+                return;
+            }
+
+            ending_ = true;
+
+            release_end();
+        }
+    private:
+
+        class flush_port_type final
+            : public receiver<continue_msg>
+        {
+        public:
+
+            flush_port_type(sample_node& owner)
+                : owner_(owner)
+            {
+            }
+
+            bool try_put(input_type& i, predecessor_type* s) override
+            {
+                owner_.flush();
+
+                return true;
+            }
+        private:
+            sample_node& owner_;
+        };
+
+        // Uniform in (0, 1].
+        static double uniform(std::mt19937_64& rng)
+        {
+            return (static_cast<double>(rng() >> 11) + 1) * (1.0 / 9007199254740992.0);
+        }
+
+        // Messages before the next success of trials that each succeed with probability p.
+        static std::int64_t geometric(std::mt19937_64& rng, double p)
+        {
+            if (p >= 1)
+                return 0;
+
+            if (!(p > 0))
+                return std::numeric_limits<std::int64_t>::max();
+
+            auto skip = std::floor(std::log(uniform(rng)) / std::log(1 - p));
+
+            return skip < static_cast<double>(std::numeric_limits<std::int64_t>::max()) ? static_cast<std::int64_t>(skip) : std::numeric_limits<std::int64_t>::max();
+        }
+
+        std::int64_t next_skip(worker& w)
+        {
+            if (spec_.mode == sample_mode::every_nth)
+                return static_cast<std::int64_t>(spec_.size) - 1;
+
+            return geometric(w.rng, spec_.rate);
+        }
+
+        void keep(worker& w, T& i)
+        {
+            std::lock_guard<std::mutex> lock(w.mutex);
+
+            w.seen += w.armed + 1;
+
+            if (w.reservoir.size() < spec_.size)
+            {
+                w.reservoir.push_back(i);
+
+                if (w.reservoir.size() < spec_.size)
+                {
+                    w.armed = 0;
+                    w.skip.store(0, std::memory_order_relaxed);
+                    return;
+                }
+
+                w.w = std::exp(std::log(uniform(w.rng)) / spec_.size);
+            }
+            else
+            {
+                w.reservoir[w.rng() % spec_.size] = i;
+                w.w *= std::exp(std::log(uniform(w.rng)) / spec_.size);
+            }
+
+            w.armed = geometric(w.rng, w.w);
+            w.skip.store(w.armed, std::memory_order_relaxed);
+        }
+
+        // NOTE: Called under mutex_.
+        void emit_sample()
+        {
+            if (spec_.mode != sample_mode::reservoir)
+                return;
+
+            std::vector<std::vector<T>> samples;
+            std::vector<std::uint64_t> counts;
+            std::uint64_t total = 0;
+
+            {
+                std::lock_guard<std::mutex> lock(all_mutex_);
+
+                for (auto& w : all_)
+                {
+                    std::lock_guard<std::mutex> worker_lock(w->mutex);
+
+                    auto remaining = std::max<std::int64_t>(w->skip.exchange(0, std::memory_order_relaxed), 0);
+
+                    counts.push_back(w->seen + (w->armed - remaining));
+                    total += counts.back();
+
+                    samples.push_back(std::move(w->reservoir));
+                    w->reservoir.clear();
+                    w->seen = 0;
+                    w->armed = 0;
+                }
+            }
+
+            std::random_device seed;
+            std::mt19937_64 rng(seed());
+
+            // NOTE: Drawing without replacement keeps the merged sample uniform over the whole stream.
+            for (std::size_t n = 0; n < spec_.size && total > 0; ++n)
+            {
+                auto pick = rng() % total;
+
+                std::size_t k = 0;
+                for (; pick >= counts[k]; ++k)
+                    pick -= counts[k];
+
+                auto& sample = samples[k];
+                std::swap(sample[rng() % sample.size()], sample.back());
+
+                auto o = std::move(sample.back());
+                sample.pop_back();
+
+                --counts[k];
+                --total;
+
+                if (!queue_.empty() || !successors_.try_put(o))
+                    queue_.push(std::move(o));
+            }
+        }
+
+        void release_end()
+        {
+            if (!ending_)
+                return;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
+                if (!lock.owns_lock())
+                    return; // NOTE: The holder releases it after unlocking.
+
+                if (!ending_.exchange(false))
+                    return;
+
+                emit_sample();
+            }
+
+            successors_.put_watermark(end_of_stream);
+        }
+
+        worker* create()
+        {
+            std::unique_ptr<worker> w(new worker());
+            w->reservoir.reserve(spec_.size);
+
+            std::lock_guard<std::mutex> lock(all_mutex_);
+
+            all_.push_back(std::move(w));
+
+            return all_.back().get();
+        }
+
+        const sample_spec                       spec_;
+        successor_cache<output_type>            successors_;
+        predecessor_cache<input_type>           predecessors_;
+        std::queue<output_type>                 queue_;
+        std::vector<std::unique_ptr<worker>>    all_;
+        std::mutex                              all_mutex_;
+        concurrency::combinable<worker*>        workers_;
+        flush_port_type                         flush_;
+        watermark_tracker<T>                    watermarks_;
+        std::mutex                              mutex_;
+        std::atomic<bool>                       ending_;    // NOTE: end_of_stream is parked, see put_watermark.
+    };
+
+    inline unsigned trailing_zeros(std::uint64_t x)
+    {
+#if defined(_MSC_VER)
+        unsigned long index;
+        return _BitScanForward64(&index, x) ? index : 64;
+#else
+        return x ? __builtin_ctzll(x) : 64;
+#endif
+    }
+
+    // Returns a mask with bit n set where p[n] == c, for up to 64 bytes.
+    inline std::uint64_t match_mask(const char* p, std::size_t size, char c)
+    {
+        ASSERT(size <= 64);
+
+        std::uint64_t mask = 0;
+        std::size_t n = 0;
+
+#if defined(__AVX2__)
+        auto needle = _mm256_set1_epi8(c);
+        for (; n + 32 <= size; n += 32)
+        {
+            auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + n));
+            mask |= std::uint64_t(static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle)))) << n;
+        }
+#elif defined(__SSE2__) || defined(_M_X64)
+        auto needle = _mm_set1_epi8(c);
+        for (; n + 16 <= size; n += 16)
+        {
+            auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + n));
+            mask |= std::uint64_t(static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, needle)))) << n;
+        }
+#endif
+
+        for (; n < size; ++n)
+        {
+            if (p[n] == c)
+                mask |= std::uint64_t(1) << n;
+        }
+
+        return mask;
+    }
+
+    using chunk = std::shared_ptr<const std::vector<char>>;
+
+    struct record_view
+    {
+        chunk           owner;  // NOTE: Keeps data alive.
+        const char*     data;
+        std::size_t     size;
+    };
+
+    // Record queue and watermark handoff shared by the nodes that cut byte chunks into records. Derived
+    // provides consume(c), which queues the records chunk c completes, and finish(), which queues the record
+    // left in carry_ at end_of_stream; both are called under mutex_. A chunk is rejected while records of
+    // earlier ones are still queued, and watermarks are held back until the queue has drained.
+    template<typename Derived, typename Output>
+    class chunk_stage
+        : public receiver<chunk>
+        , public sender<Output>
+    {
+    public:
+
+        chunk_stage(const chunk_stage&) = delete;
+        chunk_stage(chunk_stage&&) = delete;
+
+        chunk_stage& operator=(const chunk_stage&) = delete;
+        chunk_stage& operator=(chunk_stage&&) = delete;
+
+        bool try_put(input_type& i, predecessor_type* s) override
+        {
+            auto accepted = false;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                if (queue_.empty())
+                {
+                    derived().consume(i);
+
+                    while (!queue_.empty() && successors_.try_put(queue_.front()))
+                        queue_.pop();
+
+                    accepted = true;
+                }
+                else
+                    predecessors_.add(s);
+            }
+
+            release_watermark();
+
+            return accepted;
+        }
+
+        bool try_get(output_type& o, successor_type* r) override
+        {
+            auto result = false;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                input_type i;
+                while (queue_.empty() && predecessors_.try_get(i))
+                    derived().consume(i);
+
+                if (!queue_.empty())
+                {
+                    o = std::move(queue_.front());
+                    queue_.pop();
+
+                    result = true;
+                }
+                else
+                    successors_.add(r);
+            }
+
+            release_watermark();
+
+            return result;
+        }
+
+        void register_successor(successor_type& r) override
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                successors_.register_successor(&r);
+            }
+
+            release_watermark();
+        }
+
+        std::size_t pending() override
+        {
+            std::size_t count = 0;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                count = queue_.size();
+            }
+
+            release_watermark();
+
+            return count;
+        }
+
+        void register_predecessor(predecessor_type& s) override
+        {
+            watermarks_.add(&s);
+        }
+
+        // NOTE: Held back while records are queued. May arrive while this node pulls under its lock, so it is
+        // parked and released by whoever holds the lock next; every section under mutex_ calls
+        // release_watermark() after unlocking.
+        void put_watermark(watermark w, predecessor_type* s) override
+        {
+            if (!watermarks_.update(w, s, w))
+                return;
+
+            {
+                std::lock_guard<std::mutex> watermark_lock(watermark_mutex_);
+
+                watermark_ = w;
+                parked_ = true;
+            }
+
+            release_watermark();
+        }
+    protected:
+
+        chunk_stage()
+            : successors_(this)
+            , predecessors_(this)
+            , parked_(false)
+        {
+        }
+
+        std::queue<output_type>         queue_;
+        std::vector<record_view>        carry_;     // NOTE: Pieces of a record still missing its delimiter.
+    private:
+
+        Derived& derived()
+        {
+            return static_cast<Derived&>(*this);
+        }
+
+        void release_watermark()
+        {
+            while (parked_)
+            {
+                std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
+                if (!lock.owns_lock())
+                    return; // NOTE: The holder releases it after unlocking.
+
+                watermark w;
+                {
+                    std::lock_guard<std::mutex> watermark_lock(watermark_mutex_);
+
+                    w = *watermark_;
+                }
+
+                if (w == end_of_stream && !carry_.empty())
+                {
+                    derived().finish();
+
+                    while (!queue_.empty() && successors_.try_put(queue_.front()))
+                        queue_.pop();
+                }
+
+                if (!queue_.empty())
+                    return;
+
+                {
+                    std::lock_guard<std::mutex> watermark_lock(watermark_mutex_);
+
+                    if (*watermark_ == w)
+                        parked_ = false;
+                }
+
+                successors_.put_watermark(w);
+            }
+        }
+
+        successor_cache<output_type>    successors_;
+        predecessor_cache<input_type>   predecessors_;
+        std::mutex                      mutex_;
+        watermark_tracker<chunk>        watermarks_;
+        boost::optional<watermark>      watermark_;
+        std::atomic<bool>               parked_;
+        std::mutex                      watermark_mutex_;
+    };
+
+    // Splits byte chunks into records on a delimiter, which is dropped. Records are views into their chunk;
+    // only records that straddle chunks are copied, once they are complete. A chunk is rejected while records
+    // of earlier ones are still queued. end_of_stream emits a trailing record that has no delimiter.
+    class split_node final
+        : public chunk_stage<split_node, record_view>
+    {
+        friend class chunk_stage<split_node, record_view>;
+    public:
+
+        explicit split_node(char delimiter = '\n')
+            : delimiter_(delimiter)
+        {
+        }
+    private:
+
+        // NOTE: Called under mutex_.
+        void consume(const chunk& c)
+        {
+            auto p = c->data();
+            auto size = c->size();
+
+            std::size_t start = 0;
+            for (std::size_t base = 0; base < size; base += 64)
+            {
+                for (auto mask = match_mask(p + base, std::min<std::size_t>(64, size - base), delimiter_); mask != 0; mask &= mask - 1)
+                {
+                    auto end = base + trailing_zeros(mask);
+
+                    if (carry_.empty())
+                        queue_.push(record_view{ c, p + start, end - start });
+                    else
+                    {
+                        carry_.push_back(record_view{ c, p + start, end - start });
+                        queue_.push(stitch());
+                    }
+
+                    start = end + 1;
+                }
+            }
+
+            if (start < size)
+                carry_.push_back(record_view{ c, p + start, size - start });
+        }
+
+        // NOTE: Called under mutex_.
+        void finish()
+        {
+            queue_.push(stitch());
+        }
+
+        // Copies the pieces of a record that straddles chunks into one buffer.
+        record_view stitch()
+        {
+            std::size_t size = 0;
+            for (auto& piece : carry_)
+                size += piece.size;
+
+            auto buffer = std::make_shared<std::vector<char>>();
+            buffer->reserve(size);
+
+            for (auto& piece : carry_)
+                buffer->insert(buffer->end(), piece.data, piece.data + piece.size);
+
+            carry_.clear();
+
+            auto data = buffer->data();
+            return record_view{ std::move(buffer), data, size };
+        }
+
+        const char                      delimiter_;
+    };
+
+    // Bit n of the result is the xor of bits 0..n of x.
+    inline std::uint64_t prefix_xor(std::uint64_t x)
+    {
+        x ^= x << 1;
+        x ^= x << 2;
+        x ^= x << 4;
+        x ^= x << 8;
+        x ^= x << 16;
+        x ^= x << 32;
+
+        return x;
+    }
+
+    // Field without its surrounding quotes. Quoted fields may still contain "" escapes, see unescape().
+    struct csv_field
+    {
+        const char*     data;
+        std::size_t     size;
+        bool            quoted;
+    };
+
+    struct csv_record
+    {
+        chunk                   owner;  // NOTE: Keeps the fields' data alive.
+        std::vector<csv_field>  fields;
+    };
+
+    inline std::string unescape(const csv_field& field)
+    {
+        std::string result(field.data, field.size);
+
+        if (field.quoted)
+        {
+            std::size_t out = 0;
+            for (std::size_t in = 0; in < result.size(); ++in, ++out)
+            {
+                result[out] = result[in];
+
+                if (result[in] == '"' && in + 1 < result.size() && result[in + 1] == '"')
+                    ++in;
+            }
+
+            result.resize(out);
+        }
+
+        return result;
+    }
+
+    // Parses byte chunks of CSV (RFC 4180) into records of field views, skipping blank lines. Each 64 byte
+    // block is first classified with SIMD compares into quote, delimiter and newline bitmaps, where quoted
+    // regions (a prefix xor of the quotes) mask out the delimiters and newlines they contain; fields are then
+    // cut at the remaining bits. Like split_node, only records that straddle chunks are copied, and
+    // end_of_stream emits a trailing record that has no newline.
+    class csv_parse_node final
+        : public chunk_stage<csv_parse_node, csv_record>
+    {
+        friend class chunk_stage<csv_parse_node, csv_record>;
+    public:
+
+        explicit csv_parse_node(char delimiter = ',')
+            : delimiter_(delimiter)
+            , inside_(false)
+        {
+        }
+    private:
+
+        // Calls f(position, newline) for every delimiter and newline outside quotes. inside carries the quote
+        // state from one call to the next.
+        template<typename F>
+        void scan(const char* p, std::size_t size, bool& inside, F&& f) const
+        {
+            for (std::size_t base = 0; base < size; base += 64)
+            {
+                auto length = std::min<std::size_t>(64, size - base);
+
+                auto quotes = match_mask(p + base, length, '"');
+                auto delimiters = match_mask(p + base, length, delimiter_);
+                auto newlines = match_mask(p + base, length, '\n');
+
+                auto quoted = prefix_xor(quotes) ^ (inside ? ~std::uint64_t(0) : 0);
+                inside = (quoted >> 63) != 0;
+
+                for (auto mask = (delimiters | newlines) & ~quoted; mask != 0; mask &= mask - 1)
+                {
+                    auto n = trailing_zeros(mask);
+
+                    f(base + n, ((newlines >> n) & 1) != 0);
+                }
+            }
+        }
+
+        static csv_field field(const char* begin, const char* end, bool last)
+        {
+            // NOTE: Drops the carriage return of CRLF line endings.
+            if (last && end != begin && end[-1] == '\r')
+                --end;
+
+            if (end - begin >= 2 && *begin == '"' && end[-1] == '"')
+                return csv_field{ begin + 1, static_cast<std::size_t>(end - begin - 2), true };
+
+            return csv_field{ begin, static_cast<std::size_t>(end - begin), false };
+        }
+
+        void push(chunk owner, std::vector<csv_field> fields)
+        {
+            if (fields.size() == 1 && fields[0].size == 0 && !fields[0].quoted)
+                return;
+
+            queue_.push(csv_record{ std::move(owner), std::move(fields) });
+        }
+
+        // NOTE: Called under mutex_.
+        void consume(const chunk& c)
+        {
+            auto p = c->data();
+            auto size = c->size();
+
+            auto straddling = !carry_.empty();
+            std::size_t record = 0;
+            std::size_t start = 0;
+            std::vector<csv_field> fields;
+
+            scan(p, size, inside_, [&](std::size_t end, bool newline)
+            {
+                if (straddling)
+                {
+                    if (!newline)
+                        return;
+
+                    carry_.push_back(record_view{ c, p, end });
+                    parse_carry();
+
+                    straddling = false;
+                    record = start = end + 1;
+                    return;
+                }
+
+                fields.push_back(field(p + start, p + end, newline));
+                start = end + 1;
+
+                if (newline)
+                {
+                    push(c, std::move(fields));
+                    fields.clear();
+                    record = start;
+                }
+            });
+
+            // NOTE: The unfinished record's fields are cut again once it is stitched.
+            if (straddling || record < size)
+                carry_.push_back(record_view{ c, p + record, size - record });
+        }
+
+        // NOTE: Called under mutex_.
+        void finish()
+        {
+            parse_carry();
+            inside_ = false;
+        }
+
+        // Copies the pieces of a record that straddles chunks into one buffer and parses it.
+        void parse_carry()
+        {
+            std::size_t size = 0;
+            for (auto& piece : carry_)
+                size += piece.size;
+
+            auto buffer = std::make_shared<std::vector<char>>();
+            buffer->reserve(size);
+
+            for (auto& piece : carry_)
+                buffer->insert(buffer->end(), piece.data, piece.data + piece.size);
+
+            carry_.clear();
+
+            auto p = buffer->data();
+            auto inside = false;
+            std::size_t start = 0;
+            std::vector<csv_field> fields;
+
+            scan(p, size, inside, [&](std::size_t end, bool newline)
+            {
+                fields.push_back(field(p + start, p + end, false));
+                start = end + 1;
+            });
+
+            fields.push_back(field(p + start, p + size, true));
+
+            push(std::move(buffer), std::move(fields));
+        }
+
+        const char                      delimiter_;
+        bool                            inside_;    // NOTE: The last chunk ended inside quotes.
     };
 }
\ No newline at end of file
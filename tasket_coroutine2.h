@@ -0,0 +1,19 @@
+#pragma once
+
+#include "tasket.h"
+
+#include <boost/coroutine2/coroutine.hpp>
+
+namespace tasket
+{
+    // Coroutines policy for generator_node backed by Boost.Coroutine2. Boost.Coroutine (the default) switches
+    // through the same Boost.Context fcontext routines, so the gain is in the lighter wrapper around them;
+    // bench/coroutine_switch.cpp compares the two.
+    struct fcontext_coroutines
+    {
+        template<typename T>
+        using pull_type = typename boost::coroutines2::coroutine<T>::pull_type;
+        template<typename T>
+        using push_type = typename boost::coroutines2::coroutine<T>::push_type;
+    };
+}
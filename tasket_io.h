@@ -0,0 +1,276 @@
+#pragma once
+
+#include "tasket.h"
+
+#include <winsock2.h>
+#include <mswsock.h>
+#include <windows.h>
+
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <system_error>
+
+#pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "mswsock.lib")
+
+namespace tasket
+{
+    namespace io
+    {
+        // Inside a generator_node or multi_generator_node body, a pending operation suspends the generator's
+        // coroutine and hands the worker thread back to the executor; the Windows thread pool completion
+        // reschedules the coroutine through executor::run. Thousands of I/O-bound generators therefore only
+        // need as many threads as are running at once. Called anywhere else, the operation cooperatively
+        // blocks the calling context instead, which keeps its OS thread parked until the I/O completes.
+
+        struct operation
+            : OVERLAPPED
+        {
+            operation(std::uint64_t offset = 0)
+                : OVERLAPPED()
+                , context(concurrency::Context::CurrentContext())
+                , error(ERROR_SUCCESS)
+                , bytes(0)
+            {
+                Offset = static_cast<DWORD>(offset);
+                OffsetHigh = static_cast<DWORD>(offset >> 32);
+            }
+
+            concurrency::Context*               context;
+            generator_suspension::resume_type   resume;     // NOTE: Set while a generator is suspended on it.
+            ULONG                               error;
+            ULONG_PTR                           bytes;
+        };
+
+        // Called on completion. NOTE: op may be gone as soon as the waiter runs again.
+        inline void wake(operation& op)
+        {
+            if (op.resume)
+            {
+                auto resume = std::move(op.resume);
+                resume();
+            }
+            else
+                op.context->Unblock();
+        }
+
+        // Starts an operation with start and waits for it, suspending the current generator if there is one.
+        // start returns false if nothing was queued, in which case no completion will arrive.
+        template<typename Start>
+        void wait(operation& op, Start start)
+        {
+            auto suspension = generator_suspension::current();
+            if (!suspension)
+            {
+                if (start())
+                    op.context->Block(); // NOTE: Cooperative block.
+
+                return;
+            }
+
+            std::exception_ptr error;
+
+            suspension->suspend([&](generator_suspension::resume_type resume)
+            {
+                op.resume = std::move(resume);
+
+                try
+                {
+                    if (start())
+                        return;
+                }
+                catch (...)
+                {
+                    error = std::current_exception();
+                }
+
+                auto resume_now = std::move(op.resume);
+                resume_now();
+            });
+
+            if (error)
+                std::rethrow_exception(error);
+        }
+
+        // Wraps a handle opened for overlapped I/O (FILE_FLAG_OVERLAPPED / WSA_FLAG_OVERLAPPED).
+        class stream
+        {
+        public:
+
+            explicit stream(HANDLE handle)
+                : handle_(handle)
+                , io_(CreateThreadpoolIo(handle, &stream::complete, nullptr, nullptr))
+            {
+                if (!io_)
+                    throw std::system_error(GetLastError(), std::system_category(), "CreateThreadpoolIo");
+            }
+
+            explicit stream(SOCKET socket)
+                : stream(reinterpret_cast<HANDLE>(socket))
+            {
+            }
+
+            ~stream()
+            {
+                WaitForThreadpoolIoCallbacks(io_, TRUE);
+                CloseThreadpoolIo(io_);
+            }
+
+            stream(const stream&) = delete;
+            stream(stream&&) = delete;
+
+            stream& operator=(const stream&) = delete;
+            stream& operator=(stream&&) = delete;
+
+            // Returns 0 at end of file.
+            std::size_t read(void* buffer, std::size_t size, std::uint64_t offset = 0)
+            {
+                operation op(offset);
+
+                io::wait(op, [&]
+                {
+                    StartThreadpoolIo(io_);
+                    if (!ReadFile(handle_, buffer, static_cast<DWORD>(size), nullptr, &op))
+                    {
+                        auto error = GetLastError();
+
+                        // NOTE: Reads at or past the end can fail right away, in which case nothing is queued.
+                        if (error == ERROR_HANDLE_EOF)
+                        {
+                            CancelThreadpoolIo(io_);
+
+                            return false;
+                        }
+
+                        pending(error, "ReadFile");
+                    }
+
+                    return true;
+                });
+
+                return result(op);
+            }
+
+            std::size_t write(const void* buffer, std::size_t size, std::uint64_t offset = 0)
+            {
+                operation op(offset);
+
+                io::wait(op, [&]
+                {
+                    StartThreadpoolIo(io_);
+                    if (!WriteFile(handle_, buffer, static_cast<DWORD>(size), nullptr, &op))
+                        pending(GetLastError(), "WriteFile");
+
+                    return true;
+                });
+
+                return result(op);
+            }
+
+            // Accepts a connection on this listening socket into accepted, an unbound overlapped socket.
+            void accept(SOCKET accepted)
+            {
+                auto listener = reinterpret_cast<SOCKET>(handle_);
+
+                LPFN_ACCEPTEX accept_ex = nullptr;
+                GUID guid = WSAID_ACCEPTEX;
+                DWORD bytes = 0;
+                if (WSAIoctl(listener, SIO_GET_EXTENSION_FUNCTION_POINTER, &guid, sizeof(guid), &accept_ex, sizeof(accept_ex), &bytes, nullptr, nullptr) != 0)
+                    throw std::system_error(WSAGetLastError(), std::system_category(), "WSAIoctl");
+
+                const DWORD address_size = sizeof(SOCKADDR_STORAGE) + 16;
+                char addresses[2 * address_size];
+
+                operation op;
+
+                io::wait(op, [&]
+                {
+                    StartThreadpoolIo(io_);
+                    if (!accept_ex(listener, accepted, addresses, 0, address_size, address_size, nullptr, &op))
+                        pending(WSAGetLastError(), "AcceptEx");
+
+                    return true;
+                });
+
+                result(op);
+
+                if (setsockopt(accepted, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT, reinterpret_cast<const char*>(&listener), sizeof(listener)) != 0)
+                    throw std::system_error(WSAGetLastError(), std::system_category(), "setsockopt");
+            }
+
+            HANDLE native_handle() const
+            {
+                return handle_;
+            }
+        private:
+
+            void pending(DWORD error, const char* what)
+            {
+                if (error == ERROR_IO_PENDING)
+                    return;
+
+                CancelThreadpoolIo(io_);
+
+                throw std::system_error(error, std::system_category(), what);
+            }
+
+            static std::size_t result(const operation& op)
+            {
+                if (op.error != ERROR_SUCCESS && op.error != ERROR_HANDLE_EOF)
+                    throw std::system_error(op.error, std::system_category());
+
+                return op.bytes;
+            }
+
+            static void CALLBACK complete(PTP_CALLBACK_INSTANCE, PVOID, PVOID overlapped, ULONG result, ULONG_PTR bytes, PTP_IO)
+            {
+                auto op = static_cast<operation*>(static_cast<OVERLAPPED*>(overlapped));
+
+                op->error = result;
+                op->bytes = bytes;
+
+                wake(*op);
+            }
+
+            HANDLE  handle_;
+            PTP_IO  io_;
+        };
+
+        template<typename Rep, typename Period>
+        void sleep_for(std::chrono::duration<Rep, Period> duration)
+        {
+            struct timer
+            {
+                static void CALLBACK fire(PTP_CALLBACK_INSTANCE, PVOID context, PTP_TIMER)
+                {
+                    wake(*static_cast<operation*>(context));
+                }
+            };
+
+            operation op;
+
+            auto handle = CreateThreadpoolTimer(&timer::fire, &op, nullptr);
+            if (!handle)
+                throw std::system_error(GetLastError(), std::system_category(), "CreateThreadpoolTimer");
+
+            // NOTE: Negative due times are relative, in 100ns units.
+            ULARGE_INTEGER due_time;
+            due_time.QuadPart = static_cast<ULONGLONG>(-static_cast<LONGLONG>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count() / 100));
+
+            FILETIME due;
+            due.dwLowDateTime = due_time.LowPart;
+            due.dwHighDateTime = due_time.HighPart;
+
+            wait(op, [&]
+            {
+                SetThreadpoolTimer(handle, &due, 0, 0);
+
+                return true;
+            });
+
+            WaitForThreadpoolTimerCallbacks(handle, FALSE);
+            CloseThreadpoolTimer(handle);
+        }
+    }
+}